@@ -0,0 +1,43 @@
+#include "arena.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace moonflower {
+
+monotonic_arena::monotonic_arena(std::size_t first_block_size) : next_block_size(first_block_size) {}
+
+auto monotonic_arena::copy(std::string_view s) -> std::string_view {
+    if (s.empty()) {
+        return {};
+    }
+    auto p = static_cast<char*>(allocate(s.size(), 1));
+    std::memcpy(p, s.data(), s.size());
+    return {p, s.size()};
+}
+
+void* monotonic_arena::do_allocate(std::size_t bytes, std::size_t align) {
+    auto addr = reinterpret_cast<std::uintptr_t>(cur);
+    auto pad = (align - addr % align) % align;
+
+    if (!cur || pad + bytes > static_cast<std::size_t>(end - cur)) {
+        auto size = std::max(next_block_size, bytes + align);
+        blocks.emplace_back(new std::byte[size]);
+        cur = blocks.back().get();
+        end = cur + size;
+        next_block_size = size * 2;
+        ++counts.blocks;
+
+        addr = reinterpret_cast<std::uintptr_t>(cur);
+        pad = (align - addr % align) % align;
+    }
+
+    auto p = cur + pad;
+    cur = p + bytes;
+    ++counts.allocations;
+    counts.bytes += pad + bytes;
+    return p;
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+namespace moonflower {
+
+// Bump allocator for data that lives exactly as long as one translation unit.
+// Deallocation is a no-op; every block goes back to the heap at once when the arena is destroyed.
+class monotonic_arena : public std::pmr::memory_resource {
+public:
+    struct stats {
+        std::size_t allocations = 0; // requests served by the arena
+        std::size_t bytes = 0; // bytes handed out, including alignment padding
+        std::size_t blocks = 0; // heap allocations made by the arena itself
+    };
+
+    explicit monotonic_arena(std::size_t first_block_size = 16 * 1024);
+
+    monotonic_arena(const monotonic_arena&) = delete;
+    monotonic_arena& operator=(const monotonic_arena&) = delete;
+
+    // Copies the string into the arena.
+    auto copy(std::string_view s) -> std::string_view;
+
+    auto get_stats() const -> const stats& { return counts; }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t align) override;
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    std::byte* cur = nullptr;
+    std::byte* end = nullptr;
+    std::size_t next_block_size;
+    stats counts;
+};
+
+}
@@ -0,0 +1,199 @@
+#include "build.hpp"
+
+#include "compile.hpp"
+#include "parallel.hpp"
+#include "scriptparser.hpp"
+#include "source_file.hpp"
+#include "state.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+
+namespace moonflower {
+
+namespace {
+
+auto module_name(const std::string& path) -> std::string {
+    auto first = path.find_last_of("/\\");
+    first = first == std::string::npos ? 0 : first + 1;
+    auto last = path.find('.', first);
+    return path.substr(first, last == std::string::npos ? std::string::npos : last - first);
+}
+
+bool is_ident_char(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+}
+
+auto scan_imports(std::string_view source) -> std::vector<std::string> {
+    auto result = std::vector<std::string>{};
+    auto pos = std::size_t{0};
+
+    auto skip_blank = [&] {
+        while (pos < source.size()) {
+            if (std::isspace(static_cast<unsigned char>(source[pos]))) {
+                ++pos;
+            } else if (source.compare(pos, 2, "//") == 0) {
+                pos = source.find('\n', pos);
+                pos = pos == std::string_view::npos ? source.size() : pos + 1;
+            } else {
+                break;
+            }
+        }
+    };
+
+    auto word = [&]() -> std::string_view {
+        skip_blank();
+        auto begin = pos;
+        if (pos < source.size() && !std::isdigit(static_cast<unsigned char>(source[pos]))) {
+            while (pos < source.size() && is_ident_char(source[pos])) {
+                ++pos;
+            }
+        }
+        return source.substr(begin, pos - begin);
+    };
+
+    // the header is a run of `import NAME { names }` blocks before anything else
+    while (true) {
+        auto start = pos;
+        if (word() != "import") {
+            pos = start;
+            break;
+        }
+        auto name = word();
+        skip_blank();
+        if (name.empty() || pos >= source.size() || source[pos] != '{') {
+            break;
+        }
+        result.emplace_back(name);
+        pos = source.find('}', pos);
+        if (pos == std::string_view::npos) {
+            break;
+        }
+        ++pos;
+    }
+
+    return result;
+}
+
+auto build(state& S, const std::vector<std::string>& paths, unsigned threads) -> std::vector<build_result> {
+    const auto count = paths.size();
+
+    auto results = std::vector<build_result>(count);
+    auto sources = std::vector<std::unique_ptr<source_file>>(count);
+    auto index = std::unordered_map<std::string, std::size_t>{};
+
+    for (std::size_t i = 0; i < count; ++i) {
+        results[i].name = module_name(paths[i]);
+        sources[i] = std::make_unique<source_file>(paths[i]);
+        if (!*sources[i]) {
+            results[i].messages.emplace_back("Failed to open file: " + paths[i], location{});
+        }
+        if (!index.emplace(results[i].name, i).second) {
+            results[i].messages.emplace_back("Duplicate module name: " + results[i].name, location{});
+        }
+    }
+
+    // dependency graph, an edge from each module to the modules that import it
+
+    auto importers = std::vector<std::vector<std::size_t>>(count);
+    auto pending = std::vector<int>(count, 0);
+    auto failed = std::vector<bool>(count, false);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!results[i].messages.empty()) {
+            failed[i] = true;
+            continue;
+        }
+        for (const auto& name : scan_imports(sources[i]->text())) {
+            auto iter = index.find(name);
+            if (iter != end(index) && iter->second != i) {
+                importers[iter->second].push_back(i);
+                ++pending[i];
+            }
+        }
+    }
+
+    // a module that fails takes down everything that imports it, directly or not
+    auto fail = [&](std::size_t i) {
+        auto work = std::vector<std::size_t>{i};
+        failed[i] = true;
+        while (!work.empty()) {
+            auto f = work.back();
+            work.pop_back();
+            for (auto j : importers[f]) {
+                if (!failed[j]) {
+                    failed[j] = true;
+                    results[j].messages.emplace_back("Imported module failed to build: " + results[f].name, location{});
+                    work.push_back(j);
+                }
+            }
+        }
+    };
+
+    for (std::size_t i = 0; i < count; ++i) {
+        if (failed[i]) {
+            fail(i);
+        }
+    }
+
+    auto level = std::vector<std::size_t>{};
+    for (std::size_t i = 0; i < count; ++i) {
+        if (pending[i] == 0 && !failed[i]) {
+            level.push_back(i);
+        }
+    }
+
+    auto done = std::vector<bool>(count, false);
+    auto translations = std::vector<translation>(count);
+
+    while (!level.empty()) {
+        // modules within a level get one thread each rather than threads for their functions
+        const auto compile_threads = level.size() > 1 ? 1u : S.compile_threads;
+
+        parallel_for(level.size(), threads, [&](std::size_t l) {
+            auto i = level[l];
+            try {
+                translations[i] = S.compile_module(results[i].name, sources[i]->text(), compile_threads);
+            } catch (const moonflower_script::parser::syntax_error& e) {
+                translations[i] = {result::FAIL, {}, {{e.what(), e.location}}, {}};
+            } catch (const std::exception& e) {
+                // code generation gives up on input it does not support yet, that only fails this module
+                translations[i] = {result::FAIL, {}, {{e.what(), location{}}}, {}};
+            }
+        });
+
+        auto next = std::vector<std::size_t>{};
+        for (auto i : level) {
+            auto& tu = translations[i];
+            done[i] = true;
+            results[i].messages = std::move(tu.messages);
+            if (tu.r == result::SUCCESS) {
+                results[i].mod_idx = S.load(std::move(tu.m));
+                for (auto j : importers[i]) {
+                    if (--pending[j] == 0 && !failed[j]) {
+                        next.push_back(j);
+                    }
+                }
+            } else {
+                fail(i);
+            }
+        }
+        std::sort(begin(next), end(next));
+        level = std::move(next);
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!done[i] && !failed[i]) {
+            results[i].messages.emplace_back("Import cycle through module: " + results[i].name, location{});
+        }
+    }
+
+    return results;
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "compile_message.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace moonflower {
+
+class state;
+
+struct build_result {
+    std::string name;
+    std::optional<std::int16_t> mod_idx; // set if the module compiled and was loaded
+    std::vector<compile_message> messages;
+};
+
+// Names of the modules imported by the header of a script, in order.
+auto scan_imports(std::string_view source) -> std::vector<std::string>;
+
+// Compiles script files into the state, each module named after its file without directory and extension.
+// Imports between the given files form a dependency graph; modules whose imports are all loaded compile concurrently on
+// up to `threads` threads (0 means one per core), and each finished level is loaded before the next one starts.
+// Imports of modules outside the set must already be loaded. Results are in the order of `paths`.
+auto build(state& S, const std::vector<std::string>& paths, unsigned threads = 0) -> std::vector<build_result>;
+
+}
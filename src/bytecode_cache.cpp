@@ -0,0 +1,240 @@
+#include "bytecode_cache.hpp"
+
+#include "build.hpp"
+#include "state.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+
+#include <unistd.h>
+
+namespace moonflower {
+
+namespace {
+
+constexpr char magic[4] = {'M', 'F', 'B', 'C'};
+
+class writer {
+public:
+    template <typename T>
+    void value(const T& v) {
+        auto p = reinterpret_cast<const char*>(&v);
+        out.insert(out.end(), p, p + sizeof(v));
+    }
+
+    void string(const std::string& s) {
+        value(static_cast<std::uint32_t>(s.size()));
+        out.insert(out.end(), s.begin(), s.end());
+    }
+
+    template <typename C>
+    void array(const C& v) {
+        using T = std::remove_const_t<std::remove_reference_t<decltype(*v.data())>>;
+        value(static_cast<std::uint32_t>(v.size()));
+        auto p = reinterpret_cast<const char*>(v.data());
+        out.insert(out.end(), p, p + v.size() * sizeof(T));
+    }
+
+    std::vector<char> out;
+};
+
+class reader {
+public:
+    explicit reader(const std::vector<char>& in) : in(in) {}
+
+    template <typename T>
+    bool value(T& v) {
+        if (in.size() - pos < sizeof(v)) {
+            return false;
+        }
+        std::memcpy(&v, in.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
+    }
+
+    bool string(std::string& s) {
+        auto size = std::uint32_t{};
+        if (!value(size) || in.size() - pos < size) {
+            return false;
+        }
+        s.assign(in.data() + pos, size);
+        pos += size;
+        return true;
+    }
+
+    template <typename C>
+    bool array(C& v) {
+        using T = std::remove_reference_t<decltype(*v.data())>;
+        auto size = std::uint32_t{};
+        if (!value(size) || (in.size() - pos) / sizeof(T) < size) {
+            return false;
+        }
+        v.resize(size);
+        std::memcpy(v.data(), in.data() + pos, size * sizeof(T));
+        pos += size * sizeof(T);
+        return true;
+    }
+
+    bool at_end() const { return pos == in.size(); }
+
+private:
+    const std::vector<char>& in;
+    std::size_t pos = 0;
+};
+
+}
+
+bytecode_cache::bytecode_cache(std::string dir) : dir(std::move(dir)) {}
+
+auto bytecode_cache::key(const state& S, std::string_view source) const -> std::uint64_t {
+    auto h = hasher{};
+    h.add_value(compiler_version);
+    h.add(source);
+
+    // imported function addresses are baked into the data segment, so the key covers the index and exports of each import
+    for (const auto& name : scan_imports(source)) {
+        h.add(name);
+        if (auto mi = S.find_module(name)) {
+            h.add_value(static_cast<std::uint64_t>(*mi));
+            for (const auto& e : S.modules[*mi].exports) {
+                h.add(e.name);
+                h.add_value(e.addr);
+            }
+        }
+    }
+
+    return h.get();
+}
+
+auto bytecode_cache::find(std::uint64_t key) const -> std::optional<module> {
+    if (dir.empty()) {
+        return std::nullopt;
+    }
+
+    auto file = std::ifstream(path(key), std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    auto contents = std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    auto in = reader{contents};
+    char file_magic[4];
+    auto version = std::uint32_t{};
+    auto file_key = std::uint64_t{};
+    if (!in.value(file_magic) || std::memcmp(file_magic, magic, sizeof(magic)) != 0 ||
+        !in.value(version) || version != compiler_version ||
+        !in.value(file_key) || file_key != key) {
+        return std::nullopt;
+    }
+
+    auto m = module{};
+    auto nexports = std::uint32_t{};
+    auto nimports = std::uint32_t{};
+    if (!in.value(m.entry_point) || !in.value(m.memo_ids) || !in.array(m.text) || !in.array(m.data) || !in.value(nexports)) {
+        return std::nullopt;
+    }
+    m.exports.resize(nexports);
+    for (auto& e : m.exports) {
+        if (!in.string(e.name) || !in.value(e.addr)) {
+            return std::nullopt;
+        }
+    }
+    if (!in.value(nimports)) {
+        return std::nullopt;
+    }
+    m.imports.resize(nimports);
+    for (auto& imp : m.imports) {
+        auto nsymbols = std::uint32_t{};
+        if (!in.string(imp.modname) || !in.value(nsymbols)) {
+            return std::nullopt;
+        }
+        imp.symbols.resize(nsymbols);
+        for (auto& s : imp.symbols) {
+            if (!in.string(s.name) || !in.value(s.addr)) {
+                return std::nullopt;
+            }
+        }
+    }
+    auto nfunctions = std::uint32_t{};
+    if (!in.array(m.relocations) || !in.value(nfunctions)) {
+        return std::nullopt;
+    }
+    m.functions.resize(nfunctions);
+    for (auto& f : m.functions) {
+        if (!in.string(f.name) || !in.value(f.begin) || !in.value(f.end)) {
+            return std::nullopt;
+        }
+        f.entry = f.begin;
+    }
+    if (!in.at_end()) {
+        return std::nullopt;
+    }
+
+    return m;
+}
+
+void bytecode_cache::store(std::uint64_t key, const module& m) const {
+    if (dir.empty()) {
+        return;
+    }
+
+    auto out = writer{};
+    out.value(magic);
+    out.value(compiler_version);
+    out.value(key);
+    out.value(m.entry_point);
+    out.value(m.memo_ids);
+    out.array(m.text);
+    out.array(m.data);
+    out.value(static_cast<std::uint32_t>(m.exports.size()));
+    for (const auto& e : m.exports) {
+        out.string(e.name);
+        out.value(e.addr);
+    }
+    out.value(static_cast<std::uint32_t>(m.imports.size()));
+    for (const auto& imp : m.imports) {
+        out.string(imp.modname);
+        out.value(static_cast<std::uint32_t>(imp.symbols.size()));
+        for (const auto& s : imp.symbols) {
+            out.string(s.name);
+            out.value(s.addr);
+        }
+    }
+    out.array(m.relocations);
+    out.value(static_cast<std::uint32_t>(m.functions.size()));
+    for (const auto& f : m.functions) {
+        out.string(f.name);
+        out.value(f.begin);
+        out.value(f.end);
+    }
+
+    // write to a private file first so readers never see a partial entry
+    auto final_path = path(key);
+    auto tmp_path = final_path + "." + std::to_string(::getpid()) + "." +
+        std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".tmp";
+    {
+        auto file = std::ofstream(tmp_path, std::ios::binary);
+        file.write(out.out.data(), out.out.size());
+        if (!file) {
+            file.close();
+            std::remove(tmp_path.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp_path.c_str(), final_path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+    }
+}
+
+auto bytecode_cache::path(std::uint64_t key) const -> std::string {
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+    return dir + "/" + name + ".mfc";
+}
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace moonflower {
+
+class state;
+
+// On-disk cache of compiled script modules.
+// Entries are keyed by a hash of the source, the compiler version and the index and exports of every module the source
+// imports, so a cached module is only used when compiling again would produce the same bytecode. An empty directory
+// disables the cache.
+class bytecode_cache {
+public:
+    // Bump whenever the compiler's output for a given source changes.
+    static constexpr std::uint32_t compiler_version = 7;
+
+    bytecode_cache() = default;
+    explicit bytecode_cache(std::string dir);
+
+    explicit operator bool() const { return !dir.empty(); }
+
+    auto key(const state& S, std::string_view source) const -> std::uint64_t;
+
+    auto find(std::uint64_t key) const -> std::optional<module>;
+
+    // Failing to write is not an error, the module is simply compiled again next time.
+    void store(std::uint64_t key, const module& m) const;
+
+private:
+    auto path(std::uint64_t key) const -> std::string;
+
+    std::string dir;
+};
+
+}
@@ -0,0 +1,72 @@
+#include "compact_text.hpp"
+
+#include <optional>
+
+namespace moonflower {
+
+namespace {
+
+bool fits(int value, int bits) {
+    return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+}
+
+auto encode(const instruction& instr) -> std::optional<std::uint32_t> {
+    if (instr.R != 0 || !fits(instr.A, 8)) {
+        return std::nullopt;
+    }
+    auto word = std::uint32_t(instr.OP) | (std::uint32_t(instr.A) & 0xff) << 8;
+    switch (compact::shape_of(instr.OP)) {
+        case compact::DI_HIGH:
+            if ((instr.DI & 0xffff) != 0) {
+                return std::nullopt;
+            }
+            return word | std::uint32_t(instr.DI);
+        case compact::DI_LOW:
+            if (!fits(instr.DI, 16)) {
+                return std::nullopt;
+            }
+            return word | std::uint32_t(instr.DI) << 16;
+        case compact::BC:
+            if (!fits(instr.BC.B, 8) || !fits(instr.BC.C, 8)) {
+                return std::nullopt;
+            }
+            return word | (std::uint32_t(instr.BC.B) & 0xff) << 16 | std::uint32_t(instr.BC.C) << 24;
+    }
+    return std::nullopt;
+}
+
+constexpr std::uint32_t unassigned = 0xffffffff; // an escape to no wide slot yet
+
+void encode_range(const segment<instruction>& text, compact_text& to, std::size_t first, std::size_t last) {
+    auto& words = to.words;
+    auto& wide = to.wide;
+    words.resize(text.size(), unassigned);
+
+    for (auto pc = first; pc < last; ++pc) {
+        const auto& instr = text[pc];
+        if (auto word = encode(instr)) {
+            words[pc] = *word;
+        } else if ((words[pc] & 0xff) == compact::escape && (words[pc] >> 8) < wide.size()) {
+            wide[words[pc] >> 8] = instr;
+        } else {
+            words[pc] = compact::escape | std::uint32_t(wide.size()) << 8;
+            wide.push_back(instr);
+        }
+    }
+}
+
+}
+
+compact_text encode_compact(const module& m) {
+    auto result = compact_text{};
+    encode_range(m.text, result, 0, m.text.size());
+    return result;
+}
+
+void update_compact(module& m, std::size_t first, std::size_t last) {
+    if (!m.compact.words.empty()) {
+        encode_range(m.text, m.compact, first, last);
+    }
+}
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace moonflower {
+
+// Compact text: the 32-bit encoding interp runs when state::compact is set, derived from a module's text when it is
+// loaded. Every instruction keeps its index, so text addresses, jump offsets and program_addrs mean the same in both.
+// The low byte of a word is the opcode and the next one A as a signed 8-bit field; the high half holds either B and C
+// as signed 8-bit fields, or DI for the opcodes that take it: as a signed 16-bit field, or for FSETC the high half of
+// the float, whose low half must be zero. Instructions whose operands don't fit, or that use R, are stored whole in
+// compact_text::wide and replaced by an escape word holding their index there.
+namespace compact {
+
+constexpr std::uint8_t escape = 0xff;
+
+// What the high half of a word holds.
+enum shape {
+    DI_HIGH,
+    DI_LOW,
+    BC,
+};
+
+constexpr shape shape_of(opcode op) {
+    switch (op) {
+        case FSETC:
+            return DI_HIGH;
+        case TERMINATE:
+        case ISETC:
+        case BSETC:
+        case SETADR:
+        case SETDATW:
+        case JMP:
+        case JMPIFN:
+        case JMPTABW:
+        case FORPREP:
+        case FORLOOP:
+        case RET:
+        case LAZY:
+        case CFLOAD:
+        case CFCALL:
+            return DI_LOW;
+        default:
+            return BC;
+    }
+}
+
+// The operands of a word that is not an escape, read in place by interp.
+struct word {
+    std::uint32_t bits;
+
+    opcode OP() const { return static_cast<opcode>(bits & 0xff); }
+    std::uint8_t R() const { return 0; }
+    std::int16_t A() const { return std::int8_t(bits >> 8); }
+    std::int16_t B() const { return std::int8_t(bits >> 16); }
+    std::int16_t C() const { return std::int8_t(bits >> 24); }
+    std::int32_t DI() const { return std::int32_t(bits) >> 16; }
+    bool DB0() const { return (bits >> 16) & 0xff; }
+    float DF() const {
+        auto high = bits & 0xffff0000;
+        auto f = float{};
+        std::memcpy(&f, &high, sizeof(f));
+        return f;
+    }
+};
+
+}
+
+// Encodes the whole text of `m`.
+compact_text encode_compact(const module& m);
+
+// Re-encodes text [first, last) after it was appended or patched, reusing the wide slots it had. Does nothing for a
+// module that has no compact text yet.
+void update_compact(module& m, std::size_t first, std::size_t last);
+
+}
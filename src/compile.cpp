@@ -1,17 +1,47 @@
 #include "compile.hpp"
 
+#include "function_layout.hpp"
 #include "scriptlexer.hpp"
 #include "scriptparser.hpp"
 #include "script_context.hpp"
 
+#include <limits>
+
 namespace moonflower {
 
-translation compile(state& S, const std::string& name, std::istream& source) {
-    auto context = moonflower::script_context{S};
-    context.program.push_back(moonflower::instruction{moonflower::TERMINATE});
+namespace {
+
+auto emit_int_op(opcode op) {
+    return [op](script_context& context, const address& dest, const address& lhs, const address& rhs) {
+        auto dest_l = std::get<addresses::local>(dest).value;
+        auto lhs_l = std::get<addresses::local>(lhs).value;
+        auto rhs_l = std::get<addresses::local>(rhs).value;
+        context.emit({op, dest_l, {lhs_l, rhs_l}});
+    };
+}
 
-    auto& bool_type = context.new_usertype("bool");
-    auto bool_type_ptr = context.get_global_type("bool");
+void emit_int_move(script_context& context, std::int16_t dest, std::int16_t source) {
+    if (dest != source) {
+        context.emit({opcode::CPY, dest, {source, static_cast<std::int16_t>(sizeof(int))}});
+    }
+}
+
+// returns k if x == 2^k
+auto exact_log2(std::int16_t x) -> std::optional<std::int16_t> {
+    if (x <= 0 || (x & (x - 1)) != 0) {
+        return std::nullopt;
+    }
+    auto k = std::int16_t(0);
+    while ((1 << k) != x) {
+        ++k;
+    }
+    return k;
+}
+
+// The builtin types are shared by every module compiled into a state, so they are only defined once per state.
+void define_builtin_types(type_interner& types) {
+    auto& bool_type = types.new_usertype("bool");
+    auto bool_type_ptr = types.global("bool");
     bool_type.size = sizeof(bool);
     bool_type.align = alignof(bool);
     bool_type.emit_boolean = [](script_context& context, const address& dest, const address& source) {
@@ -22,78 +52,177 @@ translation compile(state& S, const std::string& name, std::istream& source) {
         }
     };
 
-    auto& int_type = context.new_usertype("int");
-    auto int_type_ptr = context.get_global_type("int");
+    auto& int_type = types.new_usertype("int");
+    auto int_type_ptr = types.global("int");
     int_type.size = sizeof(int);
     int_type.align = alignof(int);
     int_type.binops[binop::ADD] = {
-        { int_type_ptr, int_type_ptr,
-        [](script_context& context, const address& dest, const address& lhs, const address& rhs) {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IADD),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            auto rhs_l = std::get<addresses::local>(rhs).value;
-            context.emit({opcode::IADD, dest_l, {lhs_l, rhs_l}});
-        },
+            if (rhs == 0) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else {
+                context.emit({opcode::IADDC, dest_l, {lhs_l, rhs}});
+            }
+        }}
+    };
+    int_type.binops[binop::SUB] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::ISUB),
         [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            context.emit({opcode::IADDC, dest_l, {lhs_l, rhs}});
+            if (rhs == 0) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else if (rhs == std::numeric_limits<std::int16_t>::min()) {
+                // -rhs doesn't fit
+                context.emit({opcode::IADDC, dest_l, {lhs_l, 16384}});
+                context.emit({opcode::IADDC, dest_l, {dest_l, 16384}});
+            } else {
+                context.emit({opcode::IADDC, dest_l, {lhs_l, static_cast<std::int16_t>(-rhs)}});
+            }
         }}
     };
-    int_type.binops[binop::SUB] = {
-        { int_type_ptr, int_type_ptr,
-        [](script_context& context, const address& dest, const address& lhs, const address& rhs) {
+    int_type.binops[binop::MUL] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IMUL),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
+            auto dest_l = std::get<addresses::local>(dest).value;
+            auto lhs_l = std::get<addresses::local>(lhs).value;
+            if (rhs == 0) {
+                context.emit({opcode::ISETC, dest_l, 0});
+            } else if (rhs == 1) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else if (auto shift = exact_log2(rhs)) {
+                context.emit({opcode::ISHLC, dest_l, {lhs_l, *shift}});
+            } else {
+                context.emit({opcode::IMULC, dest_l, {lhs_l, rhs}});
+            }
+        }}
+    };
+    int_type.binops[binop::DIV] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IDIV),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
+            auto dest_l = std::get<addresses::local>(dest).value;
+            auto lhs_l = std::get<addresses::local>(lhs).value;
+            // a shift only matches truncating division for non-negative x, the fixup costs more than the division
+            if (rhs == 1) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else if (rhs == -1) {
+                context.emit({opcode::IMULC, dest_l, {lhs_l, rhs}});
+            } else {
+                context.emit({opcode::IDIVC, dest_l, {lhs_l, rhs}});
+            }
+        }, true}
+    };
+    int_type.binops[binop::MOD] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IMOD),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            auto rhs_l = std::get<addresses::local>(rhs).value;
-            context.emit({opcode::ISUB, dest_l, {lhs_l, rhs_l}});
-        },
+            if (rhs == 1 || rhs == -1) {
+                context.emit({opcode::ISETC, dest_l, 0});
+            } else {
+                context.emit({opcode::IMODC, dest_l, {lhs_l, rhs}});
+            }
+        }, true}
+    };
+    int_type.binops[binop::SHL] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::ISHL),
         [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            context.emit({opcode::IADDC, dest_l, {lhs_l, static_cast<std::int16_t>(-rhs)}});
+            auto shift = static_cast<std::int16_t>(rhs & 31);
+            if (shift == 0) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else {
+                context.emit({opcode::ISHLC, dest_l, {lhs_l, shift}});
+            }
         }}
     };
-    int_type.binops[binop::MUL] = {
-        { int_type_ptr, int_type_ptr,
-        [](script_context& context, const address& dest, const address& lhs, const address& rhs) {
+    int_type.binops[binop::SHR] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::ISHR),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            auto rhs_l = std::get<addresses::local>(rhs).value;
-            context.emit({opcode::IMUL, dest_l, {lhs_l, rhs_l}});
+            auto shift = static_cast<std::int16_t>(rhs & 31);
+            if (shift == 0) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else {
+                context.emit({opcode::ISHRC, dest_l, {lhs_l, shift}});
+            }
         }}
     };
-    int_type.binops[binop::DIV] = {
-        { int_type_ptr, int_type_ptr,
-        [](script_context& context, const address& dest, const address& lhs, const address& rhs) {
+    int_type.binops[binop::AND] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IAND),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            auto rhs_l = std::get<addresses::local>(rhs).value;
-            context.emit({opcode::IDIV, dest_l, {lhs_l, rhs_l}});
+            if (rhs == 0) {
+                context.emit({opcode::ISETC, dest_l, 0});
+            } else if (rhs == -1) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else {
+                context.emit({opcode::IANDC, dest_l, {lhs_l, rhs}});
+            }
         }}
     };
-    int_type.binops[binop::CLT] = {
-        { int_type_ptr, bool_type_ptr,
-        [](script_context& context, const address& dest, const address& lhs, const address& rhs) {
+    int_type.binops[binop::OR] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IOR),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
-            auto rhs_l = std::get<addresses::local>(rhs).value;
-            context.emit({opcode::ICLT, dest_l, {lhs_l, rhs_l}});
-        },
+            if (rhs == 0) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else if (rhs == -1) {
+                context.emit({opcode::ISETC, dest_l, -1});
+            } else {
+                context.emit({opcode::IORC, dest_l, {lhs_l, rhs}});
+            }
+        }}
+    };
+    int_type.binops[binop::XOR] = {
+        { int_type_ptr, int_type_ptr, emit_int_op(opcode::IXOR),
+        [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
+            auto dest_l = std::get<addresses::local>(dest).value;
+            auto lhs_l = std::get<addresses::local>(lhs).value;
+            if (rhs == 0) {
+                emit_int_move(context, dest_l, lhs_l);
+            } else {
+                context.emit({opcode::IXORC, dest_l, {lhs_l, rhs}});
+            }
+        }}
+    };
+    int_type.binops[binop::CLT] = {
+        { int_type_ptr, bool_type_ptr, emit_int_op(opcode::ICLT),
         [](script_context& context, const address& dest, const address& lhs, std::int16_t rhs) {
             auto dest_l = std::get<addresses::local>(dest).value;
             auto lhs_l = std::get<addresses::local>(lhs).value;
             context.emit({opcode::ICLTC, dest_l, {lhs_l, rhs}});
         }}
     };
+}
+
+}
+
+translation compile(state& S, const std::string& name, std::string_view source, unsigned threads) {
+    auto context = moonflower::script_context{S};
+    context.compile_threads = threads;
+    context.program.push_back(moonflower::instruction{moonflower::TERMINATE});
+
+    S.types.define_builtins(define_builtin_types);
 
-    auto lexer = moonflower_script::lexer{source};
+    // the lexer reads the caller's buffer in place
+    auto lexer = moonflower_script::lexer{reflex::Input{source.data(), source.size()}};
+    lexer.symbols = &context.symbols;
     auto parser = moonflower_script::parser{lexer, context};
 
     //parser.set_debug_level(1);
 
     bool success = parser.parse() == 0;
 
+    context.link_functions();
+
     for (auto& msg : context.messages) {
         if (msg.severity == compile_message::ERROR) {
             success = false;
@@ -105,12 +234,28 @@ translation compile(state& S, const std::string& name, std::istream& source) {
     m.name = name;
     m.text = std::move(context.program);
     m.data = std::move(context.data);
+    m.exports = std::move(context.exports);
+    m.imports = std::move(context.imports);
+    m.relocations = std::move(context.relocations);
     m.entry_point = context.main_entry;
+    m.pending = std::move(context.pending);
+    m.memo_ids = static_cast<std::int16_t>(context.memo_count);
+
+    // stubs are laid out in definition order, bodies in the order they first run
+    if (success && !m.pending) {
+        layout_functions(m, context.functions);
+    }
+
+    for (const auto& f : context.functions) {
+        auto begin = static_cast<std::uint32_t>(f.begin);
+        m.functions.push_back({f.name, begin, begin, static_cast<std::uint32_t>(f.end)});
+    }
 
     return {
         success ? result::SUCCESS : result::FAIL,
         std::move(m),
-        std::move(context.messages)
+        std::move(context.messages),
+        context.arena.get_stats()
     };
 }
 
@@ -3,11 +3,13 @@
 #include "translation.hpp"
 
 #include <string>
+#include <string_view>
 
 namespace moonflower {
 
 class state;
 
-translation compile(state& S, const std::string& name, std::istream& source);
+// Optimizes the function bodies on `threads` threads, 0 means one per core.
+translation compile(state& S, const std::string& name, std::string_view source, unsigned threads);
 
 }
@@ -0,0 +1,74 @@
+#include "control_flow.hpp"
+
+#include "instruction_info.hpp"
+
+#include <algorithm>
+
+namespace moonflower {
+
+auto build_control_flow(const std::vector<instruction>& text, const std::vector<jump_table>& tables) -> control_flow {
+    const auto size = static_cast<int>(text.size());
+
+    auto leaders = std::vector<bool>(size + 1, false);
+    leaders[0] = true;
+    leaders[size] = true;
+
+    for (int i = 0; i < size; ++i) {
+        if (auto target = jump_target(text[i], i)) {
+            leaders[std::clamp(*target, 0, size)] = true;
+        }
+        if (text[i].OP == JMPTAB) {
+            for (auto target : tables[text[i].BC.B].targets) {
+                leaders[std::clamp(target, 0, size)] = true;
+            }
+        }
+        if (is_jump(text[i].OP) || text[i].OP == JMPTAB || !falls_through(text[i].OP)) {
+            leaders[i + 1] = true;
+        }
+    }
+
+    auto cfg = control_flow{};
+    cfg.block_of.resize(size, -1);
+
+    for (int i = 0; i < size;) {
+        auto b = basic_block{i, i + 1, {}, {}};
+        while (!leaders[b.end]) {
+            ++b.end;
+        }
+        for (int j = b.begin; j < b.end; ++j) {
+            cfg.block_of[j] = cfg.blocks.size();
+        }
+        cfg.blocks.push_back(std::move(b));
+        i = cfg.blocks.back().end;
+    }
+
+    const auto nblocks = static_cast<int>(cfg.blocks.size());
+    for (int bi = 0; bi < nblocks; ++bi) {
+        auto& b = cfg.blocks[bi];
+        const auto& last = text[b.end - 1];
+        auto add_succ = [&](int pc) {
+            if (pc >= 0 && pc < size) {
+                auto s = cfg.block_of[pc];
+                if (std::find(begin(b.succs), end(b.succs), s) == end(b.succs)) {
+                    b.succs.push_back(s);
+                    cfg.blocks[s].preds.push_back(bi);
+                }
+            }
+        };
+        if (auto target = jump_target(last, b.end - 1)) {
+            add_succ(*target);
+        }
+        if (last.OP == JMPTAB) {
+            for (auto target : tables[last.BC.B].targets) {
+                add_succ(target);
+            }
+        }
+        if (falls_through(last.OP)) {
+            add_succ(b.end);
+        }
+    }
+
+    return cfg;
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace moonflower {
+
+struct jump_table {
+    int jmptab; // text index of the JMPTAB
+    std::int32_t low; // index value of the first target
+    std::vector<int> targets; // text index per index value
+};
+
+struct basic_block {
+    int begin;
+    int end;
+    std::vector<int> succs;
+    std::vector<int> preds;
+};
+
+struct control_flow {
+    std::vector<basic_block> blocks;
+    std::vector<int> block_of; // instruction index -> block index
+};
+
+// JMPTAB refers to its table by index into tables.
+auto build_control_flow(const std::vector<instruction>& text, const std::vector<jump_table>& tables = {}) -> control_flow;
+
+}
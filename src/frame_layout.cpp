@@ -0,0 +1,535 @@
+#include "frame_layout.hpp"
+
+#include "control_flow.hpp"
+#include "instruction_info.hpp"
+#include "utility.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <numeric>
+
+namespace moonflower {
+
+namespace {
+
+constexpr std::int16_t linkage_size = 2 * sizeof(int); // ?retaddr and ?retstack, see script_context::begin_func
+constexpr std::int16_t frame_align = alignof(std::max_align_t);
+
+constexpr int UNDEFINED = -1;
+constexpr int ENTRY = 0;
+
+// A callee frame which is not nested in another one. Everything at or above `ret` is owned by the call
+// between `begin` and `call`, and is moved as a single block.
+struct window {
+    int begin;
+    int call;
+    std::int16_t ret;
+    std::int16_t top;
+    int anchor = -1; // def id of the return value
+};
+
+// A stack operand outside of any callee frame.
+struct occurrence {
+    int pc;
+    operand_field field;
+    std::int16_t addr;
+    std::int16_t size;
+    bool write;
+    int def; // def id for writes, reaching def for reads
+};
+
+struct web {
+    std::int16_t addr = 0;
+    std::int16_t size = 0;
+    std::int16_t end = 0;
+    bool uniform = true;
+    bool pinned = false;
+    bool placed = false;
+    std::int16_t new_addr = 0;
+    int first_pc = -1;
+    std::vector<int> windows; // windows whose return value this is
+};
+
+class union_find {
+public:
+    int add() {
+        parent.push_back(parent.size());
+        return parent.size() - 1;
+    }
+
+    int find(int i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    void unite(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a != b) {
+            parent[std::max(a, b)] = std::min(a, b);
+        }
+    }
+
+private:
+    std::vector<int> parent;
+};
+
+auto natural_align(std::int16_t size) -> std::int16_t {
+    auto align = std::int16_t{1};
+    while (align < frame_align && size % (align * 2) == 0) {
+        align *= 2;
+    }
+    return align;
+}
+
+auto align_up(int addr, int align) -> int {
+    return (addr + align - 1) / align * align;
+}
+
+}
+
+void layout_frame(function_context& func, std::int16_t param_top) {
+    auto& text = func.text;
+    const auto size = static_cast<int>(text.size());
+
+    if (size == 0) {
+        return;
+    }
+
+    for (const auto& instr : text) {
+        if (!is_analyzable(instr.OP)) {
+            return;
+        }
+    }
+
+    // callee frames, only the outermost ones matter since nested frames move along with them
+
+    auto windows = std::vector<window>{};
+    auto window_at = std::vector<int>(size, -1);
+    auto enclosing = std::vector<int>(func.call_sites.size(), -1);
+
+    for (std::size_t i = 0; i < func.call_sites.size(); ++i) {
+        const auto& site = func.call_sites[i];
+        auto nested = std::any_of(begin(func.call_sites), end(func.call_sites), [&](const call_site& o) {
+            return o.begin <= site.begin && site.call < o.call;
+        });
+        if (!nested) {
+            windows.push_back({site.begin, site.call, site.ret, text[site.call].A});
+        }
+    }
+
+    std::sort(begin(windows), end(windows), [](const window& a, const window& b) { return a.begin < b.begin; });
+    const auto nwindows = static_cast<int>(windows.size());
+
+    for (int w = 0; w < nwindows; ++w) {
+        for (int pc = windows[w].begin; pc <= windows[w].call; ++pc) {
+            window_at[pc] = w;
+        }
+    }
+
+    for (std::size_t i = 0; i < func.call_sites.size(); ++i) {
+        if (window_at[func.call_sites[i].call] == -1) {
+            return;
+        }
+        enclosing[i] = window_at[func.call_sites[i].call];
+    }
+
+    for (int pc = 0; pc < size; ++pc) {
+        if (text[pc].OP == CALL && window_at[pc] == -1) {
+            return;
+        }
+    }
+
+    // collect operands and give every write its own def
+
+    auto defs = union_find{};
+    defs.add(); // ENTRY
+
+    auto occurrences = std::vector<occurrence>{};
+    auto occ_begin = std::vector<int>(size + 1, 0);
+    auto nbytes = static_cast<int>(param_top);
+
+    for (int pc = 0; pc < size; ++pc) {
+        occ_begin[pc] = occurrences.size();
+        auto w = window_at[pc];
+        for (const auto& op : stack_operands(text[pc])) {
+            auto addr = get_field(text[pc], op.field);
+            if (op.mode == access::FRAME || addr < 0 || op.size <= 0) {
+                continue;
+            }
+            if (w != -1 && addr >= windows[w].ret) {
+                continue;
+            }
+            auto def = op.mode == access::WRITE ? defs.add() : UNDEFINED;
+            occurrences.push_back({pc, op.field, addr, op.size, op.mode == access::WRITE, def});
+            nbytes = std::max(nbytes, addr + op.size);
+        }
+        if (w != -1 && windows[w].call == pc) {
+            windows[w].anchor = defs.add();
+            nbytes = std::max(nbytes, int(windows[w].top));
+        }
+    }
+    occ_begin[size] = occurrences.size();
+
+    // reaching definitions per byte, defs that reach the same read are merged into one web
+
+    auto cfg = build_control_flow(text, func.jump_tables);
+    const auto nblocks = static_cast<int>(cfg.blocks.size());
+
+    using byte_state = std::vector<int>;
+
+    auto entry_state = byte_state(nbytes, UNDEFINED);
+    std::fill(begin(entry_state), begin(entry_state) + param_top, ENTRY);
+
+    auto merge_into = [&](byte_state& into, const byte_state& from) {
+        for (int i = 0; i < nbytes; ++i) {
+            if (from[i] == UNDEFINED) {
+                continue;
+            }
+            if (into[i] == UNDEFINED) {
+                into[i] = from[i];
+            } else {
+                defs.unite(into[i], from[i]);
+            }
+        }
+    };
+
+    auto transfer = [&](int pc, byte_state& state) {
+        for (int oi = occ_begin[pc]; oi < occ_begin[pc + 1]; ++oi) {
+            auto& occ = occurrences[oi];
+            if (occ.write) {
+                std::fill(begin(state) + occ.addr, begin(state) + occ.addr + occ.size, occ.def);
+            } else {
+                auto reaching = UNDEFINED;
+                for (int i = occ.addr; i < occ.addr + occ.size; ++i) {
+                    if (state[i] == UNDEFINED) {
+                        continue;
+                    }
+                    if (reaching == UNDEFINED) {
+                        reaching = state[i];
+                    } else {
+                        defs.unite(reaching, state[i]);
+                    }
+                }
+                if (reaching == UNDEFINED) {
+                    // reads garbage, keep it where it is
+                    reaching = ENTRY;
+                }
+                occ.def = reaching;
+            }
+        }
+        auto w = window_at[pc];
+        if (w != -1 && windows[w].call == pc) {
+            const auto& win = windows[w];
+            std::fill(begin(state) + win.ret, end(state), UNDEFINED);
+            std::fill(begin(state) + win.ret, begin(state) + win.top, win.anchor);
+        }
+    };
+
+    auto block_out = std::vector<byte_state>(nblocks, byte_state(nbytes, UNDEFINED));
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int b = 0; b < nblocks; ++b) {
+            auto state = b == 0 ? entry_state : byte_state(nbytes, UNDEFINED);
+            for (auto p : cfg.blocks[b].preds) {
+                merge_into(state, block_out[p]);
+            }
+            for (int pc = cfg.blocks[b].begin; pc < cfg.blocks[b].end; ++pc) {
+                transfer(pc, state);
+            }
+            for (auto& d : state) {
+                if (d != UNDEFINED) {
+                    d = defs.find(d);
+                }
+            }
+            for (auto& d : block_out[b]) {
+                if (d != UNDEFINED) {
+                    d = defs.find(d);
+                }
+            }
+            if (state != block_out[b]) {
+                block_out[b] = std::move(state);
+                changed = true;
+            }
+        }
+    }
+
+    // number the webs
+
+    auto web_of_def = std::vector<int>{};
+    auto webs = std::vector<web>{};
+
+    auto get_web = [&](int def) {
+        def = defs.find(def);
+        if (static_cast<std::size_t>(def) >= web_of_def.size()) {
+            web_of_def.resize(def + 1, -1);
+        }
+        if (web_of_def[def] == -1) {
+            web_of_def[def] = webs.size();
+            webs.emplace_back();
+            webs.back().addr = -1;
+        }
+        return web_of_def[def];
+    };
+
+    auto add_range = [&](int wi, std::int16_t addr, std::int16_t size, int pc) {
+        auto& wb = webs[wi];
+        if (wb.addr == -1) {
+            wb.addr = addr;
+            wb.size = size;
+            wb.end = addr + size;
+            wb.first_pc = pc;
+        } else {
+            wb.uniform = wb.uniform && wb.addr == addr && wb.size == size;
+            wb.addr = std::min(wb.addr, addr);
+            wb.end = std::max(wb.end, static_cast<std::int16_t>(addr + size));
+            wb.size = wb.end - wb.addr;
+            wb.first_pc = std::min(wb.first_pc, pc);
+        }
+    };
+
+    get_web(ENTRY);
+    webs[0].pinned = true;
+
+    for (auto& occ : occurrences) {
+        occ.def = get_web(occ.def);
+        add_range(occ.def, occ.addr, occ.size, occ.pc);
+    }
+
+    for (int w = 0; w < nwindows; ++w) {
+        auto& win = windows[w];
+        win.anchor = get_web(win.anchor);
+        add_range(win.anchor, win.ret, win.top - win.ret, win.call);
+        webs[win.anchor].windows.push_back(w);
+    }
+
+    if (webs[0].addr == -1) {
+        webs[0].addr = 0;
+        webs[0].end = 0;
+    }
+
+    const auto nwebs = static_cast<int>(webs.size());
+
+    for (auto& wb : webs) {
+        if (!wb.uniform) {
+            wb.pinned = true;
+        }
+    }
+
+    // liveness and interference of webs
+
+    auto interferes = std::vector<dynamic_bitset>(nwebs, dynamic_bitset(nwebs));
+    auto touches = std::vector<dynamic_bitset>(windows.size(), dynamic_bitset(nwebs));
+
+    auto add_interference = [&](int a, int b) {
+        if (a != b) {
+            interferes[a].set(b);
+            interferes[b].set(a);
+        }
+    };
+
+    auto kills = [&](const occurrence& occ) {
+        const auto& wb = webs[occ.def];
+        return !wb.pinned && occ.addr == wb.addr && occ.size == wb.size;
+    };
+
+    auto live_in = std::vector<dynamic_bitset>(nblocks, dynamic_bitset(nwebs));
+
+    auto walk_block = [&](int b, bool record) {
+        auto live = dynamic_bitset(nwebs);
+        for (auto s : cfg.blocks[b].succs) {
+            live.merge(live_in[s]);
+        }
+        for (int pc = cfg.blocks[b].end - 1; pc >= cfg.blocks[b].begin; --pc) {
+            auto w = window_at[pc];
+            if (record && w != -1) {
+                touches[w].merge(live);
+            }
+
+            if (w != -1 && windows[w].call == pc) {
+                auto anchor = windows[w].anchor;
+                if (record) {
+                    live.for_each([&](std::size_t l) { add_interference(anchor, l); });
+                }
+                if (!webs[anchor].pinned) {
+                    live.reset(anchor);
+                }
+            }
+
+            for (int oi = occ_begin[pc + 1] - 1; oi >= occ_begin[pc]; --oi) {
+                const auto& occ = occurrences[oi];
+                if (occ.write) {
+                    if (record) {
+                        live.for_each([&](std::size_t l) { add_interference(occ.def, l); });
+                    }
+                    if (kills(occ)) {
+                        live.reset(occ.def);
+                    }
+                }
+            }
+
+            for (int oi = occ_begin[pc]; oi < occ_begin[pc + 1]; ++oi) {
+                const auto& occ = occurrences[oi];
+                if (!occ.write) {
+                    live.set(occ.def);
+                }
+                if (record && w != -1) {
+                    touches[w].set(occ.def);
+                }
+            }
+
+            // std::copy_n must not see partially overlapping ranges
+            if (record && text[pc].OP == CPY && occ_begin[pc + 1] - occ_begin[pc] == 2) {
+                add_interference(occurrences[occ_begin[pc]].def, occurrences[occ_begin[pc] + 1].def);
+            }
+
+            if (record && w != -1) {
+                touches[w].merge(live);
+            }
+        }
+        return live;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int b = nblocks - 1; b >= 0; --b) {
+            auto live = walk_block(b, false);
+            if (live != live_in[b]) {
+                live_in[b] = std::move(live);
+                changed = true;
+            }
+        }
+    }
+
+    for (int b = 0; b < nblocks; ++b) {
+        walk_block(b, true);
+    }
+
+    // everything live on entry is there before the first instruction, so it must stay put
+
+    live_in[0].for_each([&](std::size_t l) {
+        webs[l].pinned = true;
+        live_in[0].for_each([&](std::size_t o) { add_interference(l, o); });
+    });
+
+    for (int w = 0; w < nwindows; ++w) {
+        touches[w].reset(windows[w].anchor);
+    }
+
+    // assign addresses, pinned webs first, then the rest in order of appearance
+
+    auto window_ret = std::vector<int>(windows.size(), -1);
+
+    for (auto& wb : webs) {
+        if (wb.pinned) {
+            wb.placed = true;
+            wb.new_addr = wb.addr;
+            for (auto w : wb.windows) {
+                window_ret[w] = windows[w].ret;
+            }
+        }
+    }
+
+    auto order = std::vector<int>(nwebs);
+    std::iota(begin(order), end(order), 0);
+    std::stable_sort(begin(order), end(order), [&](int a, int b) { return webs[a].first_pc < webs[b].first_pc; });
+
+    for (auto wi : order) {
+        auto& wb = webs[wi];
+        if (wb.placed) {
+            continue;
+        }
+
+        auto align = int(natural_align(wb.size));
+        auto residue = 0;
+        if (!wb.windows.empty()) {
+            align = frame_align;
+            residue = wb.addr % frame_align;
+        }
+
+        auto lower = int(linkage_size);
+        auto upper = int(std::numeric_limits<std::int16_t>::max());
+
+        for (int w = 0; w < nwindows; ++w) {
+            if (window_ret[w] != -1 && touches[w].test(wi)) {
+                upper = std::min(upper, window_ret[w]);
+            }
+        }
+
+        for (auto w : wb.windows) {
+            touches[w].for_each([&](std::size_t o) {
+                if (webs[o].placed) {
+                    lower = std::max(lower, webs[o].new_addr + webs[o].size);
+                }
+            });
+        }
+
+        auto addr = align_up(lower - residue, align) + residue;
+
+        for (bool moved = true; moved;) {
+            moved = false;
+            interferes[wi].for_each([&](std::size_t o) {
+                const auto& other = webs[o];
+                if (other.placed && addr < other.new_addr + other.size && other.new_addr < addr + wb.size) {
+                    addr = align_up(other.new_addr + other.size - residue, align) + residue;
+                    moved = true;
+                }
+            });
+        }
+
+        if (addr + wb.size > upper) {
+            return;
+        }
+
+        wb.new_addr = addr;
+        wb.placed = true;
+
+        for (auto w : wb.windows) {
+            if (addr > windows[w].ret) {
+                return;
+            }
+            window_ret[w] = addr;
+        }
+    }
+
+    // rewrite operands
+
+    auto shift = std::vector<int>(windows.size());
+    for (int w = 0; w < nwindows; ++w) {
+        shift[w] = window_ret[w] - windows[w].ret;
+    }
+
+    for (int pc = 0; pc < size; ++pc) {
+        auto& instr = text[pc];
+        auto w = window_at[pc];
+        auto oi = occ_begin[pc];
+        for (const auto& op : stack_operands(instr)) {
+            auto addr = get_field(instr, op.field);
+            if (op.mode == access::FRAME) {
+                set_field(instr, op.field, addr + shift[w]);
+                continue;
+            }
+            if (addr < 0 || op.size <= 0) {
+                continue;
+            }
+            if (w != -1 && addr >= windows[w].ret) {
+                set_field(instr, op.field, addr + shift[w]);
+                continue;
+            }
+            const auto& wb = webs[occurrences[oi].def];
+            set_field(instr, op.field, addr + wb.new_addr - wb.addr);
+            ++oi;
+        }
+    }
+
+    for (std::size_t i = 0; i < func.call_sites.size(); ++i) {
+        func.call_sites[i].ret += shift[enclosing[i]];
+    }
+}
+
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "script_context.hpp"
+
+#include <cstdint>
+
+namespace moonflower {
+
+// Reassigns the stack slots of a finished function so that values which are never live at the same time share
+// memory. Parameters and the return linkage keep their addresses, callee frames are moved down as a whole.
+// Leaves the function untouched if it contains anything the analysis doesn't understand.
+void layout_frame(function_context& func, std::int16_t param_top);
+
+}
@@ -0,0 +1,130 @@
+#include "function_layout.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+
+namespace moonflower {
+
+namespace {
+
+// how many times a self-recursive function is assumed to run per call from outside
+constexpr double recursion_weight = 10.0;
+
+}
+
+void layout_functions(module& m, std::vector<function_extent>& functions) {
+    const auto count = static_cast<int>(functions.size());
+
+    if (count < 2) {
+        return;
+    }
+
+    auto by_begin = std::vector<int>(count);
+    std::iota(begin(by_begin), end(by_begin), 0);
+    std::sort(begin(by_begin), end(by_begin), [&](int a, int b) {
+        return functions[a].begin < functions[b].begin;
+    });
+
+    // functions must tile the text after the prefix
+    const auto prefix = functions[by_begin[0]].begin;
+    for (int i = 0; i + 1 < count; ++i) {
+        if (functions[by_begin[i]].end != functions[by_begin[i + 1]].begin) {
+            return;
+        }
+    }
+    if (functions[by_begin.back()].end != static_cast<int>(m.text.size())) {
+        return;
+    }
+
+    auto func_at = std::unordered_map<int, int>{};
+    for (int i = 0; i < count; ++i) {
+        func_at[functions[i].begin] = i;
+    }
+
+    // static call graph, one edge per function address loaded
+
+    auto calls = std::vector<std::vector<int>>(count);
+    for (int i = 0; i < count; ++i) {
+        for (int pc = functions[i].begin; pc < functions[i].end; ++pc) {
+            if (m.text[pc].OP == SETADR) {
+                auto iter = func_at.find(m.text[pc].DI);
+                if (iter == end(func_at)) {
+                    return;
+                }
+                calls[i].push_back(iter->second);
+            }
+        }
+    }
+
+    // estimated number of calls per run of the entry point
+
+    auto freq = std::vector<double>(count, 0.0);
+
+    if (auto iter = func_at.find(m.entry_point); iter != end(func_at)) {
+        freq[iter->second] = 1.0;
+    }
+    for (const auto& exp : m.exports) {
+        auto iter = func_at.find(exp.addr);
+        if (iter == end(func_at)) {
+            return;
+        }
+        freq[iter->second] = std::max(freq[iter->second], 1.0);
+    }
+
+    // callees are always defined before their callers
+    for (int i = count - 1; i >= 0; --i) {
+        auto f = by_begin[i];
+        if (std::find(begin(calls[f]), end(calls[f]), f) != end(calls[f])) {
+            freq[f] *= recursion_weight;
+        }
+        for (auto callee : calls[f]) {
+            if (callee != f) {
+                freq[callee] += freq[f];
+            }
+        }
+    }
+
+    // hottest first, functions that never run keep their relative order at the end
+
+    auto order = by_begin;
+    std::stable_sort(begin(order), end(order), [&](int a, int b) {
+        return freq[a] > freq[b];
+    });
+
+    if (order == by_begin) {
+        return;
+    }
+
+    auto text = std::vector<instruction>(m.text.begin(), m.text.begin() + prefix);
+    text.reserve(m.text.size());
+
+    auto new_begin = std::unordered_map<int, int>{};
+    auto new_functions = std::vector<function_extent>{};
+
+    for (auto f : order) {
+        const auto& func = functions[f];
+        new_begin[func.begin] = text.size();
+        new_functions.push_back({func.name, static_cast<int>(text.size()), 0});
+        text.insert(text.end(), m.text.begin() + func.begin, m.text.begin() + func.end);
+        new_functions.back().end = text.size();
+    }
+
+    for (auto& instr : text) {
+        if (instr.OP == SETADR) {
+            instr.DI = new_begin[instr.DI];
+        }
+    }
+
+    if (auto iter = new_begin.find(m.entry_point); iter != end(new_begin)) {
+        m.entry_point = iter->second;
+    }
+    for (auto& exp : m.exports) {
+        exp.addr = new_begin[exp.addr];
+    }
+
+    m.text = std::move(text);
+    functions = std::move(new_functions);
+}
+
+}
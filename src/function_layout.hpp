@@ -0,0 +1,16 @@
+#pragma once
+
+#include "script_context.hpp"
+#include "types.hpp"
+
+#include <vector>
+
+namespace moonflower {
+
+// Reorders the functions of a compiled module so that the ones expected to run most often are contiguous at the
+// start of the text, and the ones that are never called from the entry point or an export end up at the back.
+// Function addresses in SETADR, the entry point and exports are relocated. Leaves the module untouched if it finds
+// a text address it can't relocate.
+void layout_functions(module& m, std::vector<function_extent>& functions);
+
+}
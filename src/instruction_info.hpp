@@ -0,0 +1,231 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+namespace moonflower {
+
+enum class operand_field : std::uint8_t {
+    A,
+    B,
+    C,
+};
+
+enum class access : std::uint8_t {
+    READ,
+    WRITE,
+    FRAME, // callee frame base, everything at and above it belongs to the callee
+};
+
+struct stack_operand {
+    operand_field field;
+    access mode;
+    std::int16_t size;
+};
+
+struct operand_list {
+    std::array<stack_operand, 3> ops;
+    int count = 0;
+
+    void add(operand_field f, access m, std::int16_t s) { ops[count++] = {f, m, s}; }
+
+    auto begin() const { return ops.begin(); }
+    auto end() const { return ops.begin() + count; }
+};
+
+inline std::int16_t get_field(const instruction& instr, operand_field f) {
+    switch (f) {
+        case operand_field::A: return instr.A;
+        case operand_field::B: return instr.BC.B;
+        case operand_field::C: return instr.BC.C;
+    }
+    return 0;
+}
+
+inline void set_field(instruction& instr, operand_field f, std::int16_t value) {
+    switch (f) {
+        case operand_field::A: instr.A = value; break;
+        case operand_field::B: instr.BC.B = value; break;
+        case operand_field::C: instr.BC.C = value; break;
+    }
+}
+
+// Whether the compiler's analysis passes understand the opcode.
+// Functions containing anything else are left untouched.
+inline bool is_analyzable(opcode op) {
+    switch (op) {
+        case ISETC:
+        case FSETC:
+        case BSETC:
+        case SETADR:
+        case SETXADR:
+        case SETDAT:
+        case SETDATW:
+        case CPY:
+        case IADD:
+        case ISUB:
+        case IMUL:
+        case IDIV:
+        case ICLT:
+        case IMOD:
+        case ISHL:
+        case ISHR:
+        case IAND:
+        case IOR:
+        case IXOR:
+        case IADDC:
+        case ICLTC:
+        case IMULC:
+        case IDIVC:
+        case IMODC:
+        case ISHLC:
+        case ISHRC:
+        case IANDC:
+        case IORC:
+        case IXORC:
+        case ICNEC:
+        case FADD:
+        case FSUB:
+        case FMUL:
+        case FDIV:
+        case JMP:
+        case JMPIFN:
+        case JMPTAB:
+        case FORPREP:
+        case FORLOOP:
+        case CALL:
+        case RET:
+        case MEMOGET:
+        case MEMOSET:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Stack bytes read and written by an instruction, in evaluation order (reads before writes).
+inline operand_list stack_operands(const instruction& instr) {
+    using F = operand_field;
+    using M = access;
+
+    auto ops = operand_list{};
+
+    switch (instr.OP) {
+        case ISETC:
+            ops.add(F::A, M::WRITE, sizeof(int));
+            break;
+        case FSETC:
+            ops.add(F::A, M::WRITE, sizeof(float));
+            break;
+        case SETADR:
+        case SETXADR:
+            ops.add(F::A, M::WRITE, sizeof(program_addr));
+            break;
+        case BSETC:
+            ops.add(F::A, M::WRITE, sizeof(bool));
+            break;
+        case CFLOAD:
+            ops.add(F::A, M::WRITE, sizeof(cfunc*));
+            break;
+        case SETDAT:
+            ops.add(F::A, M::WRITE, instr.BC.C);
+            break;
+        case SETDATW:
+            ops.add(F::A, M::WRITE, instr.R);
+            break;
+        case CPY:
+            ops.add(F::B, M::READ, instr.BC.C);
+            ops.add(F::A, M::WRITE, instr.BC.C);
+            break;
+        case IADD:
+        case ISUB:
+        case IMUL:
+        case IDIV:
+        case IMOD:
+        case ISHL:
+        case ISHR:
+        case IAND:
+        case IOR:
+        case IXOR:
+            ops.add(F::B, M::READ, sizeof(int));
+            ops.add(F::C, M::READ, sizeof(int));
+            ops.add(F::A, M::WRITE, sizeof(int));
+            break;
+        case ICLT:
+            ops.add(F::B, M::READ, sizeof(int));
+            ops.add(F::C, M::READ, sizeof(int));
+            ops.add(F::A, M::WRITE, sizeof(bool));
+            break;
+        case IADDC:
+        case IMULC:
+        case IDIVC:
+        case IMODC:
+        case ISHLC:
+        case ISHRC:
+        case IANDC:
+        case IORC:
+        case IXORC:
+            ops.add(F::B, M::READ, sizeof(int));
+            ops.add(F::A, M::WRITE, sizeof(int));
+            break;
+        case ICLTC:
+        case ICNEC:
+            ops.add(F::B, M::READ, sizeof(int));
+            ops.add(F::A, M::WRITE, sizeof(bool));
+            break;
+        case FADD:
+        case FSUB:
+        case FMUL:
+        case FDIV:
+            ops.add(F::B, M::READ, sizeof(float));
+            ops.add(F::C, M::READ, sizeof(float));
+            ops.add(F::A, M::WRITE, sizeof(float));
+            break;
+        case JMPIFN:
+            ops.add(F::A, M::READ, sizeof(bool));
+            break;
+        case JMPTAB:
+        case JMPTABW:
+            ops.add(F::A, M::READ, sizeof(int));
+            break;
+        case FORPREP:
+            ops.add(F::A, M::READ, 3 * sizeof(int));
+            break;
+        case FORLOOP:
+            ops.add(F::A, M::READ, 3 * sizeof(int));
+            ops.add(F::A, M::WRITE, sizeof(int));
+            break;
+        case MEMOGET:
+        case MEMOSET:
+            ops.add(F::A, M::READ, instr.BC.B);
+            break;
+        case CALL:
+            ops.add(F::B, M::READ, sizeof(program_addr));
+            ops.add(F::A, M::FRAME, 0);
+            break;
+        default:
+            break;
+    }
+
+    return ops;
+}
+
+inline bool is_jump(opcode op) {
+    return op == JMP || op == JMPIFN || op == FORPREP || op == FORLOOP;
+}
+
+inline bool falls_through(opcode op) {
+    return op != JMP && op != RET && op != TERMINATE && op != LAZY;
+}
+
+inline std::optional<int> jump_target(const instruction& instr, int pc) {
+    if (is_jump(instr.OP)) {
+        return pc + 1 + instr.DI;
+    }
+    return std::nullopt;
+}
+
+}
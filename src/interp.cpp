@@ -1,6 +1,9 @@
 #include "interp.hpp"
 
+#include "compact_text.hpp"
+
 #include <algorithm>
+#include <limits>
 
 #ifdef NDEBUG
 #define MOONFLOWER_DEBUG 0
@@ -11,6 +14,12 @@
 
 #define MOONFLOWER_PROFILE 0
 
+#if defined(__GNUC__) || defined(__clang__)
+#define MOONFLOWER_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define MOONFLOWER_ALWAYS_INLINE
+#endif
+
 #if MOONFLOWER_PROFILE
 #include <chrono>
 #include <iostream>
@@ -19,8 +28,15 @@
 
 namespace moonflower {
 
+// the return linkage is the return address, with the caller's stack offset in its reserved half
 constexpr int OFF_RET_ADDR = 0;
-constexpr int OFF_RET_STACK = 4;
+
+// Counts the interp calls in progress, so the state knows when no frame can be running old code.
+struct running_guard {
+    state& S;
+    explicit running_guard(state& S) : S(S) { ++S.running; }
+    ~running_guard() { --S.running; }
+};
 
 template <typename T>
 auto byte_cast(std::byte* stack, std::int16_t addr) -> T& {
@@ -48,206 +64,404 @@ struct profile_context {
 };
 static profile_context profile_ctx;
 #endif
-interp_result interp(state& S, std::uint16_t mod_idx, std::uint16_t func_addr, int retc) {
-    const instruction* text = S.modules[mod_idx].text.data();
+
+// Operands of a full instruction, read like those of a compact::word. They are read in place: a copy of the whole
+// instruction takes a register the switch needs for the stack or PC.
+struct operands {
+    const instruction* i;
+
+    opcode OP() const { return i->OP; }
+    std::uint8_t R() const { return i->R; }
+    std::int16_t A() const { return i->A; }
+    std::int16_t B() const { return i->BC.B; }
+    std::int16_t C() const { return i->BC.C; }
+    std::int32_t DI() const { return i->DI; }
+    bool DB0() const { return i->DB[0]; }
+    float DF() const { return i->DF; }
+};
+
+// The text interp reads: the instructions themselves, or their compact encoding.
+template <bool Compact>
+struct text_of {
+    using slot = instruction;
+    static const slot* get(const module& m) { return m.text.data(); }
+    static const instruction* wide(const module&) { return nullptr; }
+};
+
+template <>
+struct text_of<true> {
+    using slot = std::uint32_t;
+    static const slot* get(const module& m) { return m.compact.words.data(); }
+    static const instruction* wide(const module& m) { return m.compact.wide.data(); }
+};
+
+template <bool Compact>
+interp_result run(state& S, std::uint16_t mod_idx, std::uint32_t func_addr, int retc) {
+    using text_t = text_of<Compact>;
+
+    std::byte* const stack_limit = S.stack.get() + S.stacksize - script_context::stack_max;
+    const auto guard = running_guard{S};
+
+    const typename text_t::slot* text = text_t::get(S.modules[mod_idx]);
+    const instruction* wide = text_t::wide(S.modules[mod_idx]);
 #if MOONFLOWER_DEBUG
-    const instruction* text_end = S.modules[mod_idx].text.data() + S.modules[mod_idx].text.size();
+    const typename text_t::slot* text_end = text + S.modules[mod_idx].text.size();
     volatile int icount = 0;
 #endif
     const char* terminate_reason = "terminate";
     std::byte* data = S.modules[mod_idx].data.data();
-    const instruction* PC = text + func_addr;
+    cfunc* const* const natives = S.natives.table();
+    const typename text_t::slot* PC = text + func_addr;
     std::byte* stack = S.stack.get() + retc;
-    instruction I;
 
-    byte_cast<program_addr>(stack, OFF_RET_ADDR) = {0, 0};
-    byte_cast<stack_rep>(stack, OFF_RET_STACK) = {0};
+    byte_cast<program_addr>(stack, OFF_RET_ADDR) = {0, 0, 0};
 
+    const auto mf_func_call = [&](std::int16_t stack_top, program_addr addr) {
+        stack += stack_top;
+        byte_cast<program_addr>(stack, OFF_RET_ADDR) = {std::uint32_t(PC - text), mod_idx, std::uint16_t(stack_top)};
+        mod_idx = addr.mod;
+        text = text_t::get(S.modules[mod_idx]);
+        wide = text_t::wide(S.modules[mod_idx]);
+        data = S.modules[mod_idx].data.data();
+        PC = text + addr.off;
 #if MOONFLOWER_DEBUG
-    const auto fetch = [&]{
-        ++icount;
-        if (PC >= text_end) {
-            I = instruction{opcode::TERMINATE, -2};
-            terminate_reason = "runoff";
-            std::cerr << "runoff at " << (PC - text) << " module " << S.modules[mod_idx].name << " text " << (void*)text << " text_end " << (void*)text_end << "\n";
-        } else {
-            I = *PC;
-            ++PC;
-        }
-    };
-#else
-    const auto fetch = [&I, &PC]{
-        I = *PC;
-        ++PC;
-    };
+        text_end = text + S.modules[mod_idx].text.size();
 #endif
+    };
 
-    const auto mf_func_call = [&](std::int16_t stack_top, program_addr addr) {
-        stack += stack_top;
-        byte_cast<program_addr>(stack, OFF_RET_ADDR) = {mod_idx, std::uint16_t(PC - text)};
-        byte_cast<stack_rep>(stack, OFF_RET_STACK).soff = stack_top;
+    const auto mf_func_return = [&] {
+        const auto& addr = byte_cast<program_addr>(stack, OFF_RET_ADDR);
         mod_idx = addr.mod;
-        text = S.modules[mod_idx].text.data();
+        text = text_t::get(S.modules[mod_idx]);
+        wide = text_t::wide(S.modules[mod_idx]);
         data = S.modules[mod_idx].data.data();
         PC = text + addr.off;
 #if MOONFLOWER_DEBUG
         text_end = text + S.modules[mod_idx].text.size();
 #endif
+        stack -= addr.reserved;
     };
 
-    while (true) {
-        fetch();
+    // a lazy body compiled since `pc` was taken may have moved the module's text and data, also through a host
+    // function that ran a script of its own
+    const auto mf_module_moved = [&](std::ptrdiff_t pc) {
+        text = text_t::get(S.modules[mod_idx]);
+        wide = text_t::wide(S.modules[mod_idx]);
+        data = S.modules[mod_idx].data.data();
+        PC = text + pc;
+#if MOONFLOWER_DEBUG
+        text_end = text + S.modules[mod_idx].text.size();
+#endif
+    };
 
+    // runs one instruction, returns false when it ends the run with `result`
+    auto result = interp_result{};
+    const auto execute = [&](const auto I) MOONFLOWER_ALWAYS_INLINE {
 #if MOONFLOWER_PROFILE
+        // the operands are read in place, and a lazy body or a host call may have moved the text by the end
+        const auto profiled_op = I.OP();
         profile_ctx.start = clock::now();
 #endif
 
-        switch (I.OP) {
+        switch (I.OP()) {
             case TERMINATE:
-                return {I.A, terminate_reason};
+                result = {I.A(), terminate_reason};
+                return false;
 
             // constant loads
             case ISETC:
-                byte_cast<int>(stack, I.A) = I.DI;
+                byte_cast<int>(stack, I.A()) = I.DI();
                 break;
             case FSETC:
-                byte_cast<float>(stack, I.A) = I.DF;
+                byte_cast<float>(stack, I.A()) = I.DF();
                 break;
             case BSETC:
-                byte_cast<bool>(stack, I.A) = I.DB[0];
+                byte_cast<bool>(stack, I.A()) = I.DB0();
                 break;
 
             // address load
             case SETADR:
-                byte_cast<program_addr>(stack, I.A) = {mod_idx, std::uint16_t(I.DI)};
+                byte_cast<program_addr>(stack, I.A()) = {std::uint32_t(I.DI()), mod_idx};
+                break;
+            case SETXADR:
+                byte_cast<program_addr>(stack, I.A()) = {std::uint16_t(I.C()), std::uint16_t(I.B())};
                 break;
 
             // data load
             case SETDAT:
-                std::copy_n(data + I.BC.B, I.BC.C, stack + I.A);
+                std::copy_n(data + I.B(), I.C(), stack + I.A());
+                break;
+            case SETDATW:
+                std::copy_n(data + I.DI(), I.R(), stack + I.A());
                 break;
 
             // copy
             case CPY:
-                if (I.BC.C == sizeof(int)) { // optimization
-                    std::copy_n(stack + I.BC.B, sizeof(int), stack + I.A);
-                } else if (I.BC.C == sizeof(void*)) { // optimization
-                    std::copy_n(stack + I.BC.B, sizeof(void*), stack + I.A);
+                if (I.C() == sizeof(int)) { // optimization
+                    std::copy_n(stack + I.B(), sizeof(int), stack + I.A());
+                } else if (I.C() == sizeof(void*)) { // optimization
+                    std::copy_n(stack + I.B(), sizeof(void*), stack + I.A());
                 } else {
-                    std::copy_n(stack + I.BC.B, I.BC.C, stack + I.A);
+                    std::copy_n(stack + I.B(), I.C(), stack + I.A());
                 }
                 break;
 
             // integer ops
             case IADD:
-                byte_cast<int>(stack, I.A) = byte_cast<int>(stack, I.BC.B) + byte_cast<int>(stack, I.BC.C);
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) + byte_cast<int>(stack, I.C());
                 break;
             case ISUB:
-                byte_cast<int>(stack, I.A) = byte_cast<int>(stack, I.BC.B) - byte_cast<int>(stack, I.BC.C);
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) - byte_cast<int>(stack, I.C());
                 break;
             case IMUL:
-                byte_cast<int>(stack, I.A) = byte_cast<int>(stack, I.BC.B) * byte_cast<int>(stack, I.BC.C);
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) * byte_cast<int>(stack, I.C());
                 break;
-            case IDIV:
-                byte_cast<int>(stack, I.A) = byte_cast<int>(stack, I.BC.B) / byte_cast<int>(stack, I.BC.C);
+            case IDIV: {
+                // the one check left at runtime, a variable divisor can be 0 or turn INT_MIN / -1 into a trap
+                const auto x = byte_cast<int>(stack, I.B());
+                const auto y = byte_cast<int>(stack, I.C());
+                if (y == 0 || (y == -1 && x == std::numeric_limits<int>::min())) {
+                    result = {-1, y == 0 ? "division by zero" : "division overflow"};
+                    return false;
+                }
+                byte_cast<int>(stack, I.A()) = x / y;
                 break;
+            }
             case ICLT:
-                byte_cast<bool>(stack, I.A) = byte_cast<int>(stack, I.BC.B) < byte_cast<int>(stack, I.BC.C);
+                byte_cast<bool>(stack, I.A()) = byte_cast<int>(stack, I.B()) < byte_cast<int>(stack, I.C());
+                break;
+            case IMOD: {
+                const auto x = byte_cast<int>(stack, I.B());
+                const auto y = byte_cast<int>(stack, I.C());
+                if (y == 0 || (y == -1 && x == std::numeric_limits<int>::min())) {
+                    result = {-1, y == 0 ? "division by zero" : "division overflow"};
+                    return false;
+                }
+                byte_cast<int>(stack, I.A()) = x % y;
+                break;
+            }
+            case ISHL:
+                byte_cast<int>(stack, I.A()) = int(unsigned(byte_cast<int>(stack, I.B())) << (byte_cast<int>(stack, I.C()) & 31));
+                break;
+            case ISHR:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) >> (byte_cast<int>(stack, I.C()) & 31);
+                break;
+            case IAND:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) & byte_cast<int>(stack, I.C());
+                break;
+            case IOR:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) | byte_cast<int>(stack, I.C());
+                break;
+            case IXOR:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) ^ byte_cast<int>(stack, I.C());
                 break;
             
             // integer constant ops
             case IADDC:
-                byte_cast<int>(stack, I.A) = byte_cast<int>(stack, I.BC.B) + I.BC.C;
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) + I.C();
                 break;
             case ICLTC:
-                byte_cast<bool>(stack, I.A) = byte_cast<int>(stack, I.BC.B) < I.BC.C;
+                byte_cast<bool>(stack, I.A()) = byte_cast<int>(stack, I.B()) < I.C();
+                break;
+            case IMULC:
+                // unsigned, x / -1 is compiled to x * -1 and must wrap for INT_MIN
+                byte_cast<int>(stack, I.A()) = int(unsigned(byte_cast<int>(stack, I.B())) * unsigned(I.C()));
+                break;
+            case IDIVC:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) / I.C();
+                break;
+            case IMODC:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) % I.C();
+                break;
+            case ISHLC:
+                byte_cast<int>(stack, I.A()) = int(unsigned(byte_cast<int>(stack, I.B())) << (I.C() & 31));
+                break;
+            case ISHRC:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) >> (I.C() & 31);
+                break;
+            case IANDC:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) & I.C();
+                break;
+            case IORC:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) | I.C();
+                break;
+            case IXORC:
+                byte_cast<int>(stack, I.A()) = byte_cast<int>(stack, I.B()) ^ I.C();
+                break;
+            case ICNEC:
+                byte_cast<bool>(stack, I.A()) = byte_cast<int>(stack, I.B()) != I.C();
                 break;
 
             // float ops
             case FADD:
-                byte_cast<float>(stack, I.A) = byte_cast<float>(stack, I.BC.B) + byte_cast<float>(stack, I.BC.C);
+                byte_cast<float>(stack, I.A()) = byte_cast<float>(stack, I.B()) + byte_cast<float>(stack, I.C());
                 break;
             case FSUB:
-                byte_cast<float>(stack, I.A) = byte_cast<float>(stack, I.BC.B) - byte_cast<float>(stack, I.BC.C);
+                byte_cast<float>(stack, I.A()) = byte_cast<float>(stack, I.B()) - byte_cast<float>(stack, I.C());
                 break;
             case FMUL:
-                byte_cast<float>(stack, I.A) = byte_cast<float>(stack, I.BC.B) * byte_cast<float>(stack, I.BC.C);
+                byte_cast<float>(stack, I.A()) = byte_cast<float>(stack, I.B()) * byte_cast<float>(stack, I.C());
                 break;
             case FDIV:
-                byte_cast<float>(stack, I.A) = byte_cast<float>(stack, I.BC.B) / byte_cast<float>(stack, I.BC.C);
+                byte_cast<float>(stack, I.A()) = byte_cast<float>(stack, I.B()) / byte_cast<float>(stack, I.C());
                 break;
 
             // control ops
             case JMP:
-                PC += I.DI;
+                PC += I.DI();
                 break;
             case JMPIFN:
-                if (!byte_cast<bool>(stack, I.A)) {
-                    PC += I.DI;
+                if (!byte_cast<bool>(stack, I.A())) {
+                    PC += I.DI();
                 }
                 break;
-            case CALL: {
-                const auto& addr = byte_cast<program_addr>(stack, I.BC.B);
-                mf_func_call(I.A, addr);
+            case JMPTAB: {
+                const auto table = reinterpret_cast<const std::int32_t*>(data + I.B());
+                auto index = std::uint32_t(byte_cast<int>(stack, I.A())) - std::uint32_t(table[0]);
+                if (index < std::uint16_t(I.C())) {
+                    PC += table[1 + index];
+                }
                 break;
             }
-            case RET: {
-                const auto& addr = byte_cast<program_addr>(stack, OFF_RET_ADDR);
-                mod_idx = addr.mod;
-                text = S.modules[mod_idx].text.data();
-                data = S.modules[mod_idx].data.data();
-                PC = text + addr.off;
-#if MOONFLOWER_DEBUG
-                text_end = text + S.modules[mod_idx].text.size();
-#endif
-                stack -= byte_cast<stack_rep>(stack, OFF_RET_STACK).soff;
+            case JMPTABW: {
+                const auto table = reinterpret_cast<const std::int32_t*>(data + I.DI());
+                auto index = std::uint32_t(byte_cast<int>(stack, I.A())) - std::uint32_t(table[0]);
+                if (index < std::uint32_t(table[-1])) {
+                    PC += table[1 + index];
+                }
                 break;
             }
+            case FORPREP: {
+                const auto counter = byte_cast<int>(stack, I.A());
+                const auto limit = byte_cast<int>(stack, I.A() + 4);
+                const auto step = byte_cast<int>(stack, I.A() + 8);
+                if (step == 0 || (step > 0 ? !(counter < limit) : !(counter > limit))) {
+                    PC += I.DI();
+                }
+                break;
+            }
+            case FORLOOP: {
+                auto& counter = byte_cast<int>(stack, I.A());
+                const auto limit = byte_cast<int>(stack, I.A() + 4);
+                const auto step = byte_cast<int>(stack, I.A() + 8);
+                const auto next = std::int64_t(counter) + step;
+                counter = std::int32_t(std::uint32_t(counter) + std::uint32_t(step));
+                if (step > 0 ? next < limit : next > limit) {
+                    PC += I.DI();
+                }
+                break;
+            }
+            case CALL: {
+                const auto& addr = byte_cast<program_addr>(stack, I.B());
+                if (stack + I.A() > stack_limit) {
+                    result = {-1, "stack overflow"};
+                    return false;
+                }
+                mf_func_call(I.A(), addr);
+                break;
+            }
+            case RET:
+                mf_func_return();
+                break;
 
-            // C function calls
-            case CFLOAD: {
-                auto& dest = byte_cast<cfunc*>(data, I.A);
-                if constexpr (sizeof(cfunc*) == 4) {
-                    std::memcpy(&dest, &I.DI, 4);
-                } else if constexpr (sizeof(cfunc*) == 8) {
-                    std::memcpy(&dest, PC, 8);
-                    ++PC;
-                } else {
-                    static_assert("Invalid cfunc size");
+            // memoization
+            case MEMOGET:
+                if (S.memo.lookup(mod_idx, I.C(), stack + I.A(), I.B(), stack - I.R(), I.R())) {
+                    mf_func_return();
                 }
                 break;
+            case MEMOSET:
+                S.memo.store(mod_idx, I.C(), stack + I.A(), I.B(), stack - I.R(), I.R());
+                break;
+
+            case LAZY: {
+                // the first call compiles the body and turns this stub into a jump to it
+                auto stub = PC - 1 - text;
+                if (!S.resolve(mod_idx, I.DI())) {
+                    result = {-1, "module too large to compile function"};
+                    return false;
+                }
+                mf_module_moved(stub);
+                break;
             }
+
+            // C function calls
+            case CFLOAD:
+                byte_cast<cfunc*>(stack, I.A()) = natives[I.DI()];
+                break;
             case CFCALL: {
-                const auto& func = byte_cast<cfunc*>(data, I.A);
-                func(&S, stack);
+                auto pc = PC - text;
+                natives[I.DI()](&S, stack);
+                mf_module_moved(pc);
                 break;
             }
 
             // polymorphic function call
             case PFCALL: {
-                const auto& pfunc = byte_cast<polyfunc_rep>(stack, I.BC.B);
+                const auto& pfunc = byte_cast<polyfunc_rep>(stack, I.B());
                 switch (pfunc.type) {
                     case polyfunc_type::MOONFLOWER: {
-                        mf_func_call(I.A, pfunc.moonflower_func);
+                        mf_func_call(I.A(), pfunc.moonflower_func);
                         break;
                     }
                     case polyfunc_type::C: {
-                        pfunc.c_func(&S, stack + I.A);
+                        auto pc = PC - text;
+                        pfunc.c_func(&S, stack + I.A());
+                        mf_module_moved(pc);
                         break;
                     }
                 }
+                break;
             }
 
             // invalid ops
             default:
-                return {-1, "invalid operation"};
+                result = {-1, "invalid operation"};
+                return false;
         }
 
 #if MOONFLOWER_PROFILE
-        profile_ctx.results[I.OP] += clock::now() - profile_ctx.start;
-        ++profile_ctx.counts[I.OP];
+        profile_ctx.results[profiled_op] += clock::now() - profile_ctx.start;
+        ++profile_ctx.counts[profiled_op];
 #endif
+        return true;
+    };
+
+    while (true) {
+#if MOONFLOWER_DEBUG
+        ++icount;
+        if (PC >= text_end) {
+            std::cerr << "runoff at " << (PC - text) << " module " << S.modules[mod_idx].name << " text " << (void*)text << " text_end " << (void*)text_end << "\n";
+            return {-2, "runoff"};
+        }
+#endif
+        if constexpr (Compact) {
+            const auto word = compact::word{*PC++};
+            if (word.OP() == compact::escape ? !execute(operands{&wide[word.bits >> 8]}) : !execute(word)) {
+                return result;
+            }
+        } else if (!execute(operands{PC++})) {
+            return result;
+        }
+    }
+}
+
+interp_result interp(state& S, std::uint16_t mod_idx, std::uint32_t func_addr, int retc) {
+    // loaded modules are compiled or verified, so every frame fits in stack_max bytes and dips at most
+    // max_return_area below its base; only the call depth and variable divisors are left to check
+    if (retc < S.max_return_area || S.stacksize < std::size_t(retc) + script_context::stack_max) {
+        return {-1, "stack too small"};
+    }
+    if (!S.compact) {
+        return run<false>(S, mod_idx, func_addr, retc);
+    }
+    // modules loaded since the last run are encoded now, later changes to their text keep the encoding up to date
+    for (auto& m : S.modules) {
+        if (m.compact.words.size() != m.text.size()) {
+            m.compact = encode_compact(m);
+        }
     }
+    return run<true>(S, mod_idx, func_addr, retc);
 }
 
 }
@@ -6,6 +6,6 @@
 
 namespace moonflower {
 
-interp_result interp(state& S, std::uint16_t mod_idx, std::uint16_t func_addr, int retc);
+interp_result interp(state& S, std::uint16_t mod_idx, std::uint32_t func_addr, int retc);
 
 }
@@ -0,0 +1,1200 @@
+#include "ir.hpp"
+
+#include "instruction_info.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+
+namespace moonflower::ir {
+
+namespace {
+
+struct expr_key {
+    opcode op;
+    std::int32_t imm;
+    int a;
+    int b;
+
+    friend bool operator==(const expr_key& l, const expr_key& r) {
+        return l.op == r.op && l.imm == r.imm && l.a == r.a && l.b == r.b;
+    }
+};
+
+struct expr_key_hash {
+    std::size_t operator()(const expr_key& k) const {
+        auto h = std::hash<std::int32_t>{}(k.imm);
+        h = h * 31 + std::hash<int>{}(k.op);
+        h = h * 31 + std::hash<int>{}(k.a);
+        h = h * 31 + std::hash<int>{}(k.b);
+        return h;
+    }
+};
+
+bool is_pure(opcode op) {
+    switch (op) {
+        case JMP:
+        case JMPIFN:
+        case JMPTAB:
+        case FORPREP:
+        case FORLOOP:
+        case CALL:
+        case RET:
+        case MEMOGET:
+        case MEMOSET:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Whether the instruction can stop the program for some operands.
+bool may_trap(const instruction& instr) {
+    switch (instr.OP) {
+        case IDIV:
+        case IMOD:
+            return true;
+        case IDIVC:
+        case IMODC:
+            return instr.BC.C == 0 || instr.BC.C == -1;
+        default:
+            return false;
+    }
+}
+
+bool is_commutative(opcode op) {
+    switch (op) {
+        case IADD:
+        case IMUL:
+        case IAND:
+        case IOR:
+        case IXOR:
+        case FADD:
+        case FMUL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The value key of a pure instruction, given the values of its operands.
+std::optional<expr_key> key_of(const instruction& instr, const std::vector<int>& args) {
+    for (auto a : args) {
+        if (a < 0) {
+            return std::nullopt;
+        }
+    }
+
+    switch (instr.OP) {
+        case ISETC:
+        case FSETC:
+        case SETADR:
+            return expr_key{instr.OP, instr.DI, -1, -1};
+        case BSETC:
+            return expr_key{instr.OP, instr.DB[0], -1, -1};
+        case SETDAT:
+        case SETXADR:
+            return expr_key{instr.OP, (std::int32_t(instr.BC.B) << 16) | std::uint16_t(instr.BC.C), -1, -1};
+        case SETDATW:
+            return expr_key{instr.OP, instr.DI, instr.R, -1};
+        case IADDC:
+        case ICLTC:
+        case IMULC:
+        case IDIVC:
+        case IMODC:
+        case ISHLC:
+        case ISHRC:
+        case IANDC:
+        case IORC:
+        case IXORC:
+        case ICNEC:
+            return expr_key{instr.OP, instr.BC.C, args[0], -1};
+        case IADD:
+        case ISUB:
+        case IMUL:
+        case IDIV:
+        case ICLT:
+        case IMOD:
+        case ISHL:
+        case ISHR:
+        case IAND:
+        case IOR:
+        case IXOR:
+        case FADD:
+        case FSUB:
+        case FMUL:
+        case FDIV: {
+            auto a = args[0];
+            auto b = args[1];
+            if (is_commutative(instr.OP) && b < a) {
+                std::swap(a, b);
+            }
+            return expr_key{instr.OP, 0, a, b};
+        }
+        default:
+            return std::nullopt;
+    }
+}
+
+std::optional<std::int32_t> constant_of(const function& f, int v) {
+    if (v < 0 || std::size_t(v) >= f.nodes.size()) {
+        return std::nullopt;
+    }
+    const auto& instr = f.nodes[v].instr;
+    switch (instr.OP) {
+        case ISETC: return instr.DI;
+        case BSETC: return instr.DB[0];
+        default: return std::nullopt;
+    }
+}
+
+// Same results as the interpreter, without the undefined behavior. Division traps are left for run time.
+std::optional<std::int32_t> eval_int(opcode op, std::int32_t x, std::int32_t y) {
+    using u32 = std::uint32_t;
+    switch (op) {
+        case IADD:
+        case IADDC:
+            return std::int32_t(u32(x) + u32(y));
+        case ISUB:
+            return std::int32_t(u32(x) - u32(y));
+        case IMUL:
+        case IMULC:
+            return std::int32_t(u32(x) * u32(y));
+        case IDIV:
+        case IDIVC:
+        case IMOD:
+        case IMODC:
+            if (y == 0 || (x == std::numeric_limits<std::int32_t>::min() && y == -1)) {
+                return std::nullopt;
+            }
+            return (op == IDIV || op == IDIVC) ? x / y : x % y;
+        case ISHL:
+        case ISHLC:
+            return std::int32_t(u32(x) << (y & 31));
+        case ISHR:
+        case ISHRC:
+            return x >> (y & 31);
+        case IAND:
+        case IANDC:
+            return x & y;
+        case IOR:
+        case IORC:
+            return x | y;
+        case IXOR:
+        case IXORC:
+            return x ^ y;
+        case ICLT:
+        case ICLTC:
+            return x < y;
+        case ICNEC:
+            return x != y;
+        default:
+            return std::nullopt;
+    }
+}
+
+// Replaces an int operation on known values with a constant load.
+std::optional<instruction> fold_constant(const function& f, const instruction& instr, const std::vector<int>& args) {
+    if (!is_analyzable(instr.OP) || instr.OP == CPY || args.empty()) {
+        return std::nullopt;
+    }
+
+    auto x = constant_of(f, args[0]);
+    auto y = std::optional<std::int32_t>{};
+    switch (instr.OP) {
+        case IADDC:
+        case ICLTC:
+        case IMULC:
+        case IDIVC:
+        case IMODC:
+        case ISHLC:
+        case ISHRC:
+        case IANDC:
+        case IORC:
+        case IXORC:
+        case ICNEC:
+            y = instr.BC.C;
+            break;
+        default:
+            if (args.size() == 2) {
+                y = constant_of(f, args[1]);
+            }
+            break;
+    }
+
+    if (!x || !y) {
+        return std::nullopt;
+    }
+
+    auto result = eval_int(instr.OP, *x, *y);
+    if (!result) {
+        return std::nullopt;
+    }
+
+    if (instr.OP == ICLT || instr.OP == ICLTC || instr.OP == ICNEC) {
+        return instruction{BSETC, instr.A, *result != 0};
+    }
+    return instruction{ISETC, instr.A, *result};
+}
+
+std::optional<stack_operand> written_operand(const instruction& instr) {
+    for (const auto& op : stack_operands(instr)) {
+        if (op.mode == access::WRITE) {
+            return op;
+        }
+    }
+    return std::nullopt;
+}
+
+// Follows the instructions of a block and keeps track of which value each stack byte holds.
+// With fold set, reads are redirected to equivalent values, redundant stores are dropped and operations on constants
+// are evaluated, including the conditions of branches.
+void walk(function& f, bool fold) {
+    const auto num_nodes = static_cast<int>(f.nodes.size());
+
+    f.values.resize(num_nodes);
+
+    auto current = std::vector<int>(f.nbytes);
+    auto known = std::unordered_map<expr_key, int, expr_key_hash>{};
+    auto args = std::vector<int>{};
+
+    auto holds = [&](int addr, int size, int v) {
+        if (addr < 0 || size <= 0) {
+            return false;
+        }
+        for (int i = addr; i < addr + size; ++i) {
+            if (current[i] != v) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    auto available = [&](int v) {
+        return holds(f.values[v].addr, f.values[v].size, v);
+    };
+
+    auto alias_of = [&](int v) {
+        return v < num_nodes ? f.nodes[v].alias : -1;
+    };
+
+    // earliest equivalent value that can still be read
+    auto best = [&](int v) {
+        auto r = v;
+        for (auto a = alias_of(v); a >= 0; a = alias_of(a)) {
+            if (f.values[a].size == f.values[v].size && available(a)) {
+                r = a;
+            }
+        }
+        return r;
+    };
+
+    auto add_read = [](node& n, int v) {
+        if (v >= 0 && std::find(begin(n.reads), end(n.reads), v) == end(n.reads)) {
+            n.reads.push_back(v);
+        }
+    };
+
+    // returns the value that occupies exactly the given bytes, or -1 if they hold pieces of several values
+    auto observe = [&](node& n, int addr, int size) {
+        auto first = current[addr];
+
+        if (holds(addr, size, INCOMING)) {
+            auto v = static_cast<int>(f.values.size());
+            f.values.push_back({-1, std::int16_t(addr), std::int16_t(size)});
+            std::fill(begin(current) + addr, begin(current) + addr + size, v);
+            return v;
+        }
+
+        if (first >= 0 && holds(addr, size, first) && f.values[first].addr == addr && f.values[first].size == size) {
+            return first;
+        }
+
+        for (int i = addr; i < addr + size; ++i) {
+            add_read(n, current[i]);
+        }
+        return -1;
+    };
+
+    for (const auto& b : f.cfg.blocks) {
+        std::fill(begin(current), end(current), INCOMING);
+        known.clear();
+
+        for (int pc = b.begin; pc < b.end; ++pc) {
+            auto& n = f.nodes[pc];
+            if (n.dead) {
+                continue;
+            }
+
+            n.reads.clear();
+            n.alias = -1;
+            args.clear();
+
+            for (const auto& op : stack_operands(n.instr)) {
+                auto addr = get_field(n.instr, op.field);
+
+                if (op.mode == access::FRAME) {
+                    for (int i = std::max(0, int(addr)); i < f.nbytes; ++i) {
+                        add_read(n, current[i]);
+                    }
+                    continue;
+                }
+
+                if (op.mode != access::READ) {
+                    continue;
+                }
+
+                if (addr < 0 || op.size <= 0) {
+                    args.push_back(-1);
+                    continue;
+                }
+
+                auto v = observe(n, addr, op.size);
+                if (v >= 0) {
+                    if (fold) {
+                        v = best(v);
+                        set_field(n.instr, op.field, f.values[v].addr);
+                    }
+                    add_read(n, v);
+                }
+                args.push_back(v);
+            }
+
+            if (fold) {
+                if (auto folded = fold_constant(f, n.instr, args)) {
+                    n.instr = *folded;
+                    n.reads.clear();
+                    args.clear();
+                } else if (n.instr.OP == JMPIFN && args[0] >= 0) {
+                    if (auto c = constant_of(f, args[0])) {
+                        if (*c) {
+                            n.dead = true;
+                        } else {
+                            n.instr = instruction{JMP, 0, n.instr.DI};
+                            n.reads.clear();
+                        }
+                        continue;
+                    }
+                }
+            }
+
+            if (n.instr.OP == CALL) {
+                auto ret = f.call_ret[pc];
+                std::fill(begin(current) + std::max(0, int(n.instr.A)), end(current), CLOBBERED);
+                std::fill(begin(current) + ret, begin(current) + n.instr.A, pc);
+                continue;
+            }
+
+            auto w = written_operand(n.instr);
+            if (!w) {
+                continue;
+            }
+
+            auto addr = get_field(n.instr, w->field);
+
+            if (fold) {
+                if (n.instr.OP == CPY) {
+                    if (args[0] >= 0) {
+                        n.alias = args[0];
+                    }
+                } else if (auto key = key_of(n.instr, args)) {
+                    auto it = known.find(*key);
+                    if (it != end(known) && f.values[it->second].size == w->size && available(it->second)) {
+                        n.alias = it->second;
+                    } else {
+                        known[*key] = pc;
+                    }
+                }
+
+                // the slot already holds this value
+                if (n.alias >= 0 && f.values[n.alias].addr == addr && available(n.alias)) {
+                    n.dead = true;
+                    continue;
+                }
+            }
+
+            if (addr >= 0) {
+                std::fill(begin(current) + addr, begin(current) + addr + w->size, pc);
+            }
+        }
+    }
+}
+
+// Which value each byte holds on exit of a block.
+std::vector<int> exit_values(const function& f, const basic_block& b) {
+    auto owner = std::vector<int>(f.nbytes, INCOMING);
+    for (int pc = b.begin; pc < b.end; ++pc) {
+        const auto& n = f.nodes[pc];
+        if (n.dead) {
+            continue;
+        }
+        if (n.instr.OP == CALL) {
+            std::fill(begin(owner) + std::max(0, int(n.instr.A)), end(owner), CLOBBERED);
+            std::fill(begin(owner) + f.call_ret[pc], begin(owner) + n.instr.A, pc);
+        } else if (auto w = written_operand(n.instr)) {
+            auto addr = get_field(n.instr, w->field);
+            if (addr >= 0) {
+                std::fill(begin(owner) + addr, begin(owner) + addr + w->size, pc);
+            }
+        }
+    }
+    return owner;
+}
+
+bool overlaps(int a, int asize, int b, int bsize) {
+    return a < b + bsize && b < a + asize;
+}
+
+// Whether the instruction reads or writes any of the given bytes.
+bool touches(const function& f, int pc, int addr, int size) {
+    const auto& instr = f.nodes[pc].instr;
+    for (const auto& op : stack_operands(instr)) {
+        auto a = get_field(instr, op.field);
+        if (op.mode == access::FRAME) {
+            if (overlaps(f.call_ret[pc], f.nbytes, addr, size)) {
+                return true;
+            }
+        } else if (overlaps(a, op.size, addr, size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Bytes that are live on entry of a block, given the ones live on exit.
+std::vector<bool> live_in_bytes(const function& f, const basic_block& b, std::vector<bool> live) {
+    auto fill = [&](int addr, int size, bool value) {
+        for (int i = std::max(0, addr); i < std::min(f.nbytes, addr + size); ++i) {
+            live[i] = value;
+        }
+    };
+
+    for (int pc = b.end - 1; pc >= b.begin; --pc) {
+        const auto& n = f.nodes[pc];
+        if (n.dead) {
+            continue;
+        }
+        for (const auto& op : stack_operands(n.instr)) {
+            if (op.mode == access::WRITE) {
+                fill(get_field(n.instr, op.field), op.size, false);
+            } else if (op.mode == access::FRAME) {
+                fill(f.call_ret[pc], f.nbytes, false);
+            }
+        }
+        for (const auto& op : stack_operands(n.instr)) {
+            if (op.mode == access::READ) {
+                fill(get_field(n.instr, op.field), op.size, true);
+            } else if (op.mode == access::FRAME) {
+                fill(get_field(n.instr, op.field), f.nbytes, true);
+            }
+        }
+    }
+
+    return live;
+}
+
+// dom[b][d] is set if every path from the entry to block b goes through block d.
+std::vector<std::vector<bool>> dominators(const function& f) {
+    const auto& blocks = f.cfg.blocks;
+    const auto nblocks = static_cast<int>(blocks.size());
+
+    auto dom = std::vector<std::vector<bool>>(nblocks, std::vector<bool>(nblocks, true));
+    dom[0] = std::vector<bool>(nblocks, false);
+    dom[0][0] = true;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int b = 1; b < nblocks; ++b) {
+            if (blocks[b].preds.empty()) {
+                continue;
+            }
+            auto d = dom[blocks[b].preds[0]];
+            for (auto p : blocks[b].preds) {
+                for (int i = 0; i < nblocks; ++i) {
+                    d[i] = d[i] && dom[p][i];
+                }
+            }
+            d[b] = true;
+            if (d != dom[b]) {
+                dom[b] = std::move(d);
+                changed = true;
+            }
+        }
+    }
+
+    return dom;
+}
+
+}
+
+auto build(const function_context& func) -> std::optional<function> {
+    const auto size = static_cast<int>(func.text.size());
+
+    auto f = function{};
+    f.nodes.resize(size);
+    f.values.resize(size, value{-1, 0, 0});
+    f.call_ret.resize(size, 0);
+    f.tables = func.jump_tables;
+
+    for (const auto& table : f.tables) {
+        if (table.jmptab < 0 || table.jmptab >= size) {
+            return std::nullopt;
+        }
+        for (auto target : table.targets) {
+            if (target < 0 || target > size) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    f.cfg = build_control_flow(func.text, f.tables);
+
+    auto has_site = std::vector<bool>(size, false);
+    for (const auto& site : func.call_sites) {
+        f.call_ret[site.call] = site.ret;
+        has_site[site.call] = true;
+    }
+
+    for (int pc = 0; pc < size; ++pc) {
+        const auto& instr = func.text[pc];
+
+        if (!is_analyzable(instr.OP) || (instr.OP == CALL && !has_site[pc])) {
+            return std::nullopt;
+        }
+        if (auto target = jump_target(instr, pc); target && (*target < 0 || *target > size)) {
+            return std::nullopt;
+        }
+        if (instr.OP == JMPTAB && (instr.BC.B < 0 || std::size_t(instr.BC.B) >= f.tables.size() || f.tables[instr.BC.B].jmptab != pc)) {
+            return std::nullopt;
+        }
+
+        f.nodes[pc].instr = instr;
+        f.nodes[pc].block = f.cfg.block_of[pc];
+        f.values[pc].node = pc;
+
+        for (const auto& op : stack_operands(instr)) {
+            auto addr = get_field(instr, op.field);
+            f.nbytes = std::max(f.nbytes, addr + std::max(op.size, std::int16_t(1)));
+            if (op.mode == access::WRITE) {
+                f.values[pc].addr = addr;
+                f.values[pc].size = op.size;
+            }
+        }
+
+        if (instr.OP == CALL) {
+            if (f.call_ret[pc] < 0 || f.call_ret[pc] > instr.A) {
+                return std::nullopt;
+            }
+            f.values[pc].addr = f.call_ret[pc];
+            f.values[pc].size = instr.A - f.call_ret[pc];
+        }
+    }
+
+    walk(f, false);
+
+    return f;
+}
+
+void number_values(function& f) {
+    walk(f, true);
+}
+
+auto live_out_bytes(const function& f) -> std::vector<std::vector<bool>> {
+    const auto& blocks = f.cfg.blocks;
+
+    auto use = std::vector<std::vector<bool>>(blocks.size(), std::vector<bool>(f.nbytes));
+    auto def = use;
+
+    for (std::size_t bi = 0; bi < blocks.size(); ++bi) {
+        auto read = [&](int addr, int size) {
+            for (int i = std::max(0, addr); i < std::min(f.nbytes, addr + size); ++i) {
+                if (!def[bi][i]) {
+                    use[bi][i] = true;
+                }
+            }
+        };
+        auto write = [&](int addr, int size) {
+            for (int i = std::max(0, addr); i < std::min(f.nbytes, addr + size); ++i) {
+                def[bi][i] = true;
+            }
+        };
+
+        for (int pc = blocks[bi].begin; pc < blocks[bi].end; ++pc) {
+            const auto& n = f.nodes[pc];
+            if (n.dead) {
+                continue;
+            }
+            for (const auto& op : stack_operands(n.instr)) {
+                auto addr = get_field(n.instr, op.field);
+                switch (op.mode) {
+                    case access::READ:
+                        read(addr, op.size);
+                        break;
+                    case access::FRAME:
+                        read(addr, f.nbytes);
+                        write(f.call_ret[pc], f.nbytes);
+                        break;
+                    case access::WRITE:
+                        write(addr, op.size);
+                        break;
+                }
+            }
+        }
+    }
+
+    auto live_in = use;
+    auto live_out = std::vector<std::vector<bool>>(blocks.size(), std::vector<bool>(f.nbytes));
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int bi = int(blocks.size()) - 1; bi >= 0; --bi) {
+            for (auto s : blocks[bi].succs) {
+                for (int i = 0; i < f.nbytes; ++i) {
+                    if (live_in[s][i] && !live_out[bi][i]) {
+                        live_out[bi][i] = true;
+                        if (!def[bi][i]) {
+                            live_in[bi][i] = true;
+                        }
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    return live_out;
+}
+
+void remove_unreachable(function& f) {
+    const auto size = static_cast<int>(f.nodes.size());
+    auto& blocks = f.cfg.blocks;
+
+    if (blocks.empty()) {
+        return;
+    }
+
+    auto next_live = [&](int pc) {
+        while (pc < size && f.nodes[pc].dead) {
+            ++pc;
+        }
+        return pc;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+
+        // a jump to where execution continues anyway
+        for (int pc = 0; pc < size; ++pc) {
+            auto& n = f.nodes[pc];
+            if (!n.dead && is_jump(n.instr.OP) && !written_operand(n.instr) && next_live(*jump_target(n.instr, pc)) == next_live(pc + 1)) {
+                n.dead = true;
+                changed = true;
+            }
+        }
+
+        for (auto& b : blocks) {
+            b.succs.clear();
+            b.preds.clear();
+        }
+
+        auto reached = std::vector<bool>(blocks.size(), false);
+        auto work = std::vector<int>{0};
+        reached[0] = true;
+
+        while (!work.empty()) {
+            auto bi = work.back();
+            work.pop_back();
+
+            auto add_succ = [&](int s) {
+                if (std::size_t(s) < blocks.size()) {
+                    blocks[bi].succs.push_back(s);
+                    blocks[s].preds.push_back(bi);
+                    if (!reached[s]) {
+                        reached[s] = true;
+                        work.push_back(s);
+                    }
+                }
+            };
+
+            auto last = -1;
+            for (int pc = blocks[bi].begin; pc < blocks[bi].end; ++pc) {
+                if (!f.nodes[pc].dead) {
+                    last = pc;
+                }
+            }
+
+            if (last == -1) {
+                add_succ(bi + 1);
+                continue;
+            }
+
+            const auto& instr = f.nodes[last].instr;
+            if (auto target = jump_target(instr, last); target && *target < size) {
+                add_succ(f.cfg.block_of[*target]);
+            }
+            if (instr.OP == JMPTAB) {
+                for (auto target : f.tables[instr.BC.B].targets) {
+                    if (target < size) {
+                        add_succ(f.cfg.block_of[target]);
+                    }
+                }
+            }
+            if (falls_through(instr.OP)) {
+                add_succ(bi + 1);
+            }
+        }
+
+        for (std::size_t bi = 0; bi < blocks.size(); ++bi) {
+            if (reached[bi]) {
+                continue;
+            }
+            for (int pc = blocks[bi].begin; pc < blocks[bi].end; ++pc) {
+                if (!f.nodes[pc].dead) {
+                    f.nodes[pc].dead = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void remove_dead_code(function& f) {
+    const auto num_nodes = static_cast<int>(f.nodes.size());
+
+    for (bool changed = true; changed;) {
+        changed = false;
+
+        auto live_out = live_out_bytes(f);
+        auto marked = std::vector<bool>(num_nodes, false);
+        auto work = std::vector<int>{};
+
+        auto mark = [&](int v) {
+            if (v >= 0 && v < num_nodes && !marked[v]) {
+                marked[v] = true;
+                work.push_back(v);
+            }
+        };
+
+        for (int pc = 0; pc < num_nodes; ++pc) {
+            const auto& n = f.nodes[pc];
+            if (!n.dead && (!is_pure(n.instr.OP) || f.values[pc].addr < 0)) {
+                mark(pc);
+            }
+        }
+
+        for (std::size_t bi = 0; bi < f.cfg.blocks.size(); ++bi) {
+            auto owner = exit_values(f, f.cfg.blocks[bi]);
+            for (int i = 0; i < f.nbytes; ++i) {
+                if (live_out[bi][i]) {
+                    mark(owner[i]);
+                }
+            }
+        }
+
+        while (!work.empty()) {
+            auto pc = work.back();
+            work.pop_back();
+            for (auto v : f.nodes[pc].reads) {
+                mark(v);
+            }
+        }
+
+        for (int pc = 0; pc < num_nodes; ++pc) {
+            auto& n = f.nodes[pc];
+            if (!n.dead && !marked[pc]) {
+                n.dead = true;
+                changed = true;
+            }
+        }
+    }
+}
+
+void coalesce_copies(function& f) {
+    const auto num_nodes = static_cast<int>(f.nodes.size());
+
+    auto uses = std::vector<int>(num_nodes, 0);
+    for (const auto& n : f.nodes) {
+        if (!n.dead) {
+            for (auto v : n.reads) {
+                if (v < num_nodes) {
+                    ++uses[v];
+                }
+            }
+        }
+    }
+
+    auto live_out = live_out_bytes(f);
+    for (std::size_t bi = 0; bi < f.cfg.blocks.size(); ++bi) {
+        auto owner = exit_values(f, f.cfg.blocks[bi]);
+        for (int i = 0; i < f.nbytes; ++i) {
+            if (live_out[bi][i] && owner[i] >= 0) {
+                ++uses[owner[i]];
+            }
+        }
+    }
+
+    bool changed = false;
+
+    for (int pc = 0; pc < num_nodes; ++pc) {
+        auto& copy = f.nodes[pc];
+        if (copy.dead || copy.instr.OP != CPY || copy.reads.size() != 1) {
+            continue;
+        }
+
+        auto src = copy.reads[0];
+        if (src >= num_nodes || f.nodes[src].dead || f.nodes[src].block != copy.block || uses[src] != 1) {
+            continue;
+        }
+
+        auto& def = f.nodes[src];
+        auto& val = f.values[src];
+        if (def.instr.OP == CALL || val.addr != copy.instr.BC.B || val.size != copy.instr.BC.C) {
+            continue;
+        }
+
+        auto dest = copy.instr.A;
+        auto size = copy.instr.BC.C;
+
+        auto clear = true;
+        for (int i = src + 1; i < pc && clear; ++i) {
+            clear = f.nodes[i].dead || !touches(f, i, dest, size);
+        }
+        if (!clear) {
+            continue;
+        }
+
+        def.instr.A = dest;
+        val.addr = dest;
+        copy.dead = true;
+        changed = true;
+    }
+
+    if (changed) {
+        walk(f, false);
+    }
+}
+
+void hoist_invariants(function& f) {
+    const auto& blocks = f.cfg.blocks;
+    const auto nblocks = static_cast<int>(blocks.size());
+    const auto num_nodes = static_cast<int>(f.nodes.size());
+
+    if (nblocks == 0) {
+        return;
+    }
+
+    // natural loops, one per header
+
+    auto dom = dominators(f);
+
+    auto loop_at = std::vector<int>(nblocks, -1);
+    f.loops.clear();
+
+    for (int b = 0; b < nblocks; ++b) {
+        for (auto h : blocks[b].succs) {
+            if (!dom[b][h]) {
+                continue;
+            }
+            if (loop_at[h] == -1) {
+                loop_at[h] = f.loops.size();
+                f.loops.push_back({h, std::vector<bool>(nblocks, false), {}});
+                f.loops.back().blocks[h] = true;
+            }
+            auto& members = f.loops[loop_at[h]].blocks;
+            auto work = std::vector<int>{b};
+            while (!work.empty()) {
+                auto m = work.back();
+                work.pop_back();
+                if (!members[m]) {
+                    members[m] = true;
+                    work.insert(work.end(), blocks[m].preds.begin(), blocks[m].preds.end());
+                }
+            }
+        }
+    }
+
+    // outer loops first, so that code which is invariant in all of them leaves the outermost one
+
+    auto order = std::vector<int>(f.loops.size());
+    std::iota(begin(order), end(order), 0);
+    std::stable_sort(begin(order), end(order), [&](int a, int b) {
+        return std::count(begin(f.loops[a].blocks), end(f.loops[a].blocks), true) >
+            std::count(begin(f.loops[b].blocks), end(f.loops[b].blocks), true);
+    });
+
+    auto live_out = live_out_bytes(f);
+
+    for (auto li : order) {
+        auto& l = f.loops[li];
+        const auto& header = blocks[l.header];
+
+        auto in_loop = [&](int pc) {
+            return !f.nodes[pc].dead && f.nodes[pc].hoisted == -1 && l.blocks[f.nodes[pc].block];
+        };
+
+        // the preheader is placed right before the header, so the loop must not fall into it from above
+        auto above = header.begin - 1;
+        while (above >= 0 && (f.nodes[above].dead || f.nodes[above].hoisted != -1)) {
+            --above;
+        }
+        if (above >= 0 && l.blocks[f.nodes[above].block] && falls_through(f.nodes[above].instr.OP)) {
+            continue;
+        }
+
+        // bytes that must keep their value from before the loop, and the bytes observed after leaving it from a block
+        auto pinned = live_in_bytes(f, header, live_out[l.header]);
+        auto exits = std::vector<std::pair<int, std::vector<bool>>>{};
+        for (int b = 0; b < nblocks; ++b) {
+            if (!l.blocks[b]) {
+                continue;
+            }
+            for (auto s : blocks[b].succs) {
+                if (!l.blocks[s]) {
+                    exits.emplace_back(b, live_in_bytes(f, blocks[s], live_out[s]));
+                }
+            }
+        }
+
+        auto for_each_byte = [&](int pc, bool write, auto&& fn) {
+            const auto& instr = f.nodes[pc].instr;
+            for (const auto& op : stack_operands(instr)) {
+                auto addr = int(get_field(instr, op.field));
+                auto size = int(op.size);
+                if (op.mode == access::FRAME) {
+                    addr = write ? f.call_ret[pc] : addr;
+                    size = f.nbytes;
+                } else if ((op.mode == access::WRITE) != write) {
+                    continue;
+                }
+                for (int i = std::max(0, addr); i < std::min(f.nbytes, addr + size); ++i) {
+                    fn(i);
+                }
+            }
+        };
+
+        // optimistically take every pure computation, then drop the ones that depend on something the loop changes
+
+        auto taken = std::vector<bool>(num_nodes, false);
+
+        for (int pc = 0; pc < num_nodes; ++pc) {
+            const auto& instr = f.nodes[pc].instr;
+            if (!in_loop(pc) || !is_pure(instr.OP) || may_trap(instr) || !written_operand(instr)) {
+                continue;
+            }
+            taken[pc] = true;
+            for (const auto& op : stack_operands(instr)) {
+                auto addr = get_field(instr, op.field);
+                if (addr < 0 || addr + op.size > f.nbytes) {
+                    taken[pc] = false;
+                }
+            }
+            for_each_byte(pc, true, [&](int i) { taken[pc] = taken[pc] && !pinned[i]; });
+        }
+
+        constexpr int NONE = -1;
+        constexpr int SEVERAL = -2;
+
+        for (bool changed = true; changed;) {
+            changed = false;
+
+            // bytes written by code that stays in the loop, and which block writes each byte if only hoisted code does
+            auto varies = std::vector<bool>(f.nbytes, false);
+            auto writer_block = std::vector<int>(f.nbytes, NONE);
+            auto last_write = std::vector<int>(f.nbytes, -1);
+
+            for (int pc = 0; pc < num_nodes; ++pc) {
+                if (!in_loop(pc)) {
+                    continue;
+                }
+                if (!taken[pc]) {
+                    for_each_byte(pc, true, [&](int i) { varies[i] = true; });
+                    continue;
+                }
+                auto b = f.nodes[pc].block;
+                for_each_byte(pc, true, [&](int i) {
+                    writer_block[i] = (writer_block[i] == NONE || writer_block[i] == b) ? b : SEVERAL;
+                    last_write[i] = pc;
+                });
+            }
+
+            auto drop = [&](int pc) {
+                if (taken[pc]) {
+                    taken[pc] = false;
+                    changed = true;
+                }
+            };
+
+            auto drop_writers = [&](int b, int i) {
+                for (int w = blocks[b].begin; w < blocks[b].end; ++w) {
+                    if (taken[w]) {
+                        for_each_byte(w, true, [&](int j) {
+                            if (j == i) {
+                                drop(w);
+                            }
+                        });
+                    }
+                }
+            };
+
+            // a value that is used after the loop must have been computed on every way out
+            for (const auto& [e, live] : exits) {
+                for (int i = 0; i < f.nbytes; ++i) {
+                    if (live[i] && writer_block[i] >= 0 && !dom[e][writer_block[i]]) {
+                        drop_writers(writer_block[i], i);
+                    }
+                }
+            }
+
+            for (int pc = 0; pc < num_nodes; ++pc) {
+                if (!in_loop(pc)) {
+                    continue;
+                }
+                if (taken[pc]) {
+                    for_each_byte(pc, false, [&](int i) {
+                        if (varies[i]) {
+                            drop(pc);
+                        }
+                    });
+                    for_each_byte(pc, true, [&](int i) {
+                        if (varies[i] || writer_block[i] == SEVERAL) {
+                            drop(pc);
+                        }
+                    });
+                } else {
+                    // code that stays must not observe a value before hoisted code of its block overwrites it
+                    auto b = f.nodes[pc].block;
+                    for_each_byte(pc, false, [&](int i) {
+                        if (writer_block[i] == b && pc < last_write[i]) {
+                            drop_writers(b, i);
+                        }
+                    });
+                }
+            }
+        }
+
+        // dependencies always flow along forward edges, so the hoisted code runs in reverse postorder of its blocks
+
+        auto rpo = std::vector<int>{};
+        auto visited = std::vector<bool>(nblocks, false);
+        auto visit = [&](auto&& self, int b) -> void {
+            visited[b] = true;
+            for (auto s : blocks[b].succs) {
+                if (l.blocks[s] && !visited[s] && !dom[b][s]) {
+                    self(self, s);
+                }
+            }
+            rpo.push_back(b);
+        };
+        visit(visit, l.header);
+        std::reverse(begin(rpo), end(rpo));
+
+        for (auto b : rpo) {
+            for (int pc = blocks[b].begin; pc < blocks[b].end; ++pc) {
+                if (taken[pc] && in_loop(pc)) {
+                    l.hoisted.push_back(pc);
+                }
+            }
+        }
+        for (auto pc : l.hoisted) {
+            f.nodes[pc].hoisted = li;
+        }
+    }
+}
+
+void lower(const function& f, function_context& func) {
+    const auto size = static_cast<int>(f.nodes.size());
+
+    auto preheader_at = std::vector<int>(size + 1, -1);
+    for (int li = 0; li < static_cast<int>(f.loops.size()); ++li) {
+        if (!f.loops[li].hoisted.empty()) {
+            preheader_at[f.cfg.blocks[f.loops[li].header].begin] = li;
+        }
+    }
+
+    // jumps to a removed instruction land on the next surviving one, jumps into a loop from outside land on its
+    // preheader
+    auto entry_index = std::vector<int>(size + 1);
+    auto new_index = std::vector<int>(size + 1);
+    auto count = 0;
+    for (int pc = 0; pc <= size; ++pc) {
+        entry_index[pc] = count;
+        if (preheader_at[pc] != -1) {
+            count += f.loops[preheader_at[pc]].hoisted.size();
+        }
+        new_index[pc] = count;
+        if (pc < size && !f.nodes[pc].dead && f.nodes[pc].hoisted == -1) {
+            ++count;
+        }
+    }
+
+    auto landing = [&](int from, int target) {
+        auto li = preheader_at[target];
+        if (li != -1 && f.loops[li].blocks[f.nodes[from].block]) {
+            return new_index[target];
+        }
+        return entry_index[target];
+    };
+
+    auto text = std::vector<instruction>{};
+    text.reserve(count);
+
+    auto tables = std::vector<jump_table>{};
+
+    for (int pc = 0; pc < size; ++pc) {
+        if (preheader_at[pc] != -1) {
+            for (auto h : f.loops[preheader_at[pc]].hoisted) {
+                text.push_back(f.nodes[h].instr);
+            }
+        }
+        const auto& n = f.nodes[pc];
+        if (n.dead || n.hoisted != -1) {
+            continue;
+        }
+        auto instr = n.instr;
+        if (auto target = jump_target(instr, pc)) {
+            instr.DI = landing(pc, *target) - (new_index[pc] + 1);
+        }
+        if (instr.OP == JMPTAB) {
+            auto table = f.tables[instr.BC.B];
+            table.jmptab = new_index[pc];
+            for (auto& target : table.targets) {
+                target = landing(pc, target);
+            }
+            instr.BC.B = static_cast<std::int16_t>(tables.size());
+            tables.push_back(std::move(table));
+        }
+        text.push_back(instr);
+    }
+
+    func.jump_tables = std::move(tables);
+
+    func.text = std::move(text);
+
+    auto sites = std::vector<call_site>{};
+    for (const auto& site : func.call_sites) {
+        if (!f.nodes[site.call].dead) {
+            sites.push_back({new_index[site.begin], new_index[site.call], site.ret});
+        }
+    }
+    func.call_sites = std::move(sites);
+}
+
+void optimize(function_context& func) {
+    auto f = build(func);
+    if (!f) {
+        return;
+    }
+
+    number_values(*f);
+    remove_unreachable(*f);
+    remove_dead_code(*f);
+    coalesce_copies(*f);
+    remove_dead_code(*f);
+    hoist_invariants(*f);
+
+    lower(*f, func);
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "control_flow.hpp"
+#include "script_context.hpp"
+#include "types.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace moonflower::ir {
+
+// Mid-level representation of a single function.
+//
+// Every instruction becomes a node, and every node that writes to the stack defines one value. Values are in SSA
+// form within a basic block: each read refers to the exact values it observes. Stack bytes that are read before
+// being written in a block refer to an incoming value, and values that cross a block boundary flow through their
+// stack slot. Lowering turns the surviving nodes back into instructions.
+
+constexpr int INCOMING = -1; // byte has not been written in this block
+constexpr int CLOBBERED = -2; // byte was overwritten by a callee
+
+struct node {
+    instruction instr;
+    int block = 0;
+    std::vector<int> reads; // values observed by this node
+    int alias = -1; // earlier value known to hold the same contents
+    int hoisted = -1; // loop whose preheader the node was moved to
+    bool dead = false;
+};
+
+struct value {
+    int node; // defining node, -1 for incoming values
+    std::int16_t addr;
+    std::int16_t size;
+};
+
+struct loop {
+    int header; // block index
+    std::vector<bool> blocks; // block index -> member
+    std::vector<int> hoisted; // nodes that run once in front of the header, in order
+};
+
+struct function {
+    std::vector<node> nodes;
+    std::vector<value> values; // values[i] belongs to nodes[i], incoming values follow
+    std::vector<std::int16_t> call_ret; // return value address of each CALL node
+    std::vector<jump_table> tables;
+    std::vector<loop> loops;
+    control_flow cfg;
+    int nbytes = 0;
+};
+
+auto build(const function_context& func) -> std::optional<function>;
+
+// Common subexpression elimination, copy propagation and constant folding. Reads are redirected to the earliest slot
+// which still holds the same value, and stores of a value into a slot that already holds it are dropped. Branches on
+// constants become unconditional.
+void number_values(function& f);
+
+// Drops code that can't be reached and jumps to the next instruction, and updates the block edges to match.
+void remove_unreachable(function& f);
+
+// Computes, given the current nodes, the bytes that are live on exit of each block.
+auto live_out_bytes(const function& f) -> std::vector<std::vector<bool>>;
+
+// Removes nodes whose values are never observed.
+void remove_dead_code(function& f);
+
+// Lets the definition of a temporary write straight to the slot it is copied into.
+void coalesce_copies(function& f);
+
+// Moves pure computations whose operands don't change inside a loop in front of the loop header, where they run once
+// on entry instead of on every iteration. Jumps from within the loop back to the header skip them.
+void hoist_invariants(function& f);
+
+void lower(const function& f, function_context& func);
+
+void optimize(function_context& func);
+
+}
@@ -1,8 +1,583 @@
-#include "types.hpp"
+#include "loader.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace moonflower {
 
-void load_module(state& S, const module& M) {
+namespace {
+
+template <typename Header>
+class image_writer {
+public:
+    image_writer() : out(sizeof(Header)) {}
+
+    template <typename T>
+    void value(const T& v) {
+        auto p = reinterpret_cast<const char*>(&v);
+        out.insert(out.end(), p, p + sizeof(v));
+    }
+
+    void bytes(const void* p, std::size_t size) {
+        auto b = static_cast<const char*>(p);
+        out.insert(out.end(), b, b + size);
+    }
+
+    auto string(const std::string& s) -> module_file::string_ref {
+        auto ref = module_file::string_ref{static_cast<std::uint32_t>(strings.size()), static_cast<std::uint32_t>(s.size())};
+        strings += s;
+        return ref;
+    }
+
+    void align() {
+        out.resize((out.size() + module_file::alignment - 1) / module_file::alignment * module_file::alignment);
+    }
+
+    // Writes `size` bytes on an alignment boundary and returns where they went.
+    auto block(const void* p, std::size_t size) -> module_file::section {
+        align();
+        auto s = module_file::section{static_cast<std::uint32_t>(out.size()), static_cast<std::uint32_t>(size)};
+        bytes(p, size);
+        return s;
+    }
+
+    template <typename Id>
+    void begin_section(Id id) {
+        align();
+        hdr.sections[id].offset = static_cast<std::uint32_t>(out.size());
+    }
+
+    template <typename Id>
+    void end_section(Id id) {
+        hdr.sections[id].size = static_cast<std::uint32_t>(out.size() - hdr.sections[id].offset);
+    }
+
+    bool finish(std::ostream& os) {
+        std::memcpy(out.data(), &hdr, sizeof(hdr));
+        os.write(out.data(), out.size());
+        return static_cast<bool>(os);
+    }
+
+    Header hdr = {};
+    std::string strings;
+    std::vector<char> out;
+};
+
+// Keeps a loaded file's bytes alive for the segments that point into it.
+auto map_file(const std::string& path, std::size_t& size) -> std::shared_ptr<void> {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            // private and writable: the linker patches the data segment, which only copies the pages it touches
+            auto p = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ::close(fd);
+                size = st.st_size;
+                auto length = size;
+                return std::shared_ptr<void>(p, [length](void* p) { ::munmap(p, length); });
+            }
+        }
+        ::close(fd);
+    }
+
+    auto file = std::ifstream(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return nullptr;
+    }
+    size = static_cast<std::size_t>(file.tellg());
+    auto buffer = std::shared_ptr<std::byte>(new std::byte[size], std::default_delete<std::byte[]>());
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(buffer.get()), size)) {
+        return nullptr;
+    }
+    return buffer;
+}
+
+// Bounds checked access to the sections of a mapped file.
+class image_reader {
+public:
+    image_reader(std::shared_ptr<void> backing, std::size_t size) :
+        backing(std::move(backing)), base(static_cast<std::byte*>(this->backing.get())), size(size) {}
+
+    bool contains(module_file::section s) const {
+        return s.offset % module_file::alignment == 0 && s.offset <= size && size - s.offset >= s.size;
+    }
+
+    template <typename T>
+    bool value(T& v) const {
+        if (size < sizeof(v)) {
+            return false;
+        }
+        std::memcpy(&v, base, sizeof(v));
+        return true;
+    }
+
+    // tables are small, copy them out rather than require their alignment
+    template <typename T>
+    bool table(module_file::section s, std::vector<T>& v) const {
+        if (s.size % sizeof(T) != 0) {
+            return false;
+        }
+        v.resize(s.size / sizeof(T));
+        std::memcpy(v.data(), base + s.offset, s.size);
+        return true;
+    }
+
+    bool string(module_file::string_ref ref, std::string& s) const {
+        if (ref.offset > strings.size || strings.size - ref.offset < ref.size) {
+            return false;
+        }
+        s.assign(reinterpret_cast<const char*>(base + strings.offset + ref.offset), ref.size);
+        return true;
+    }
+
+    // Elements used in place, which keep the mapping alive.
+    template <typename T>
+    bool borrow(module_file::section s, segment<T>& seg) const {
+        if (!contains(s) || s.size % sizeof(T) != 0) {
+            return false;
+        }
+        seg = segment<T>(reinterpret_cast<T*>(base + s.offset), s.size / sizeof(T), backing);
+        return true;
+    }
+
+    module_file::section strings = {};
+
+private:
+    std::shared_ptr<void> backing;
+    std::byte* base;
+    std::size_t size;
+};
+
+// Fills the exports and imports of `m` from the tables of a file. Imports index into `symbols`.
+auto read_linkage(const image_reader& r, const module_file::export_entry* exports, std::size_t export_count,
+                  const module_file::import_entry* imports, std::size_t import_count,
+                  const std::vector<module_file::symbol_entry>& symbols, module& m) -> const char* {
+    m.exports.resize(export_count);
+    for (std::size_t i = 0; i < export_count; ++i) {
+        m.exports[i].addr = exports[i].addr;
+        if (!r.string(exports[i].name, m.exports[i].name) || exports[i].addr >= m.text.size()) {
+            return "bad export";
+        }
+    }
+
+    m.imports.resize(import_count);
+    for (std::size_t i = 0; i < import_count; ++i) {
+        auto& imp = m.imports[i];
+        const auto& entry = imports[i];
+        if (!r.string(entry.modname, imp.modname) || entry.first_symbol > symbols.size() ||
+            symbols.size() - entry.first_symbol < entry.symbol_count) {
+            return "bad import";
+        }
+        imp.symbols.resize(entry.symbol_count);
+        for (std::uint32_t j = 0; j < entry.symbol_count; ++j) {
+            const auto& s = symbols[entry.first_symbol + j];
+            imp.symbols[j].addr = s.addr;
+            if (!r.string(s.name, imp.symbols[j].name)) {
+                return "bad import";
+            }
+        }
+    }
+
+    for (const auto& rel : m.relocations) {
+        if (rel.offset > m.data.size() || m.data.size() - rel.offset < sizeof(program_addr) ||
+            rel.import >= m.imports.size() || rel.symbol >= m.imports[rel.import].symbols.size()) {
+            return "bad relocation";
+        }
+    }
+
+    return nullptr;
+}
+
+bool read_native(const image_reader& r, const module_file::native_entry& entry, native_import& n) {
+    return r.string(entry.name, n.name) && r.string(entry.signature, n.signature);
+}
+
+// Undoes state::load's linking of import calls in a copy of the text, so the file can be linked against other modules.
+void unlink_import_calls(const module& m, char* text) {
+    if (m.relocations.empty()) {
+        return;
+    }
+
+    auto offsets = std::unordered_map<std::uint64_t, std::int32_t>{}; // data offset of each imported program_addr
+    for (const auto& r : m.relocations) {
+        auto adr = program_addr{};
+        std::memcpy(&adr, m.data.data() + r.offset, sizeof(adr));
+        offsets.emplace((std::uint64_t(adr.mod) << 32) | adr.off, static_cast<std::int32_t>(r.offset));
+    }
+
+    for (std::size_t pc = 0; pc < m.text.size(); ++pc) {
+        const auto& instr = m.text[pc];
+        if (instr.OP == SETXADR) {
+            auto iter = offsets.find((std::uint64_t(std::uint16_t(instr.BC.B)) << 32) | std::uint16_t(instr.BC.C));
+            if (iter != offsets.end()) {
+                auto unlinked = instruction{SETDATW, instr.A, iter->second};
+                unlinked.R = sizeof(program_addr);
+                if (iter->second <= std::numeric_limits<std::int16_t>::max()) {
+                    unlinked = instruction{SETDAT, instr.A, {std::int16_t(iter->second), std::int16_t(sizeof(program_addr))}};
+                }
+                std::memcpy(text + pc * sizeof(instruction), &unlinked, sizeof(unlinked));
+            }
+        }
+    }
+}
+
+// Undoes state::load's linking of host function calls in a copy of the text, so they name the module's natives again.
+void unlink_native_calls(const module& m, char* text) {
+    if (m.native_ids.empty()) {
+        return;
+    }
+
+    auto natives = std::unordered_map<std::int32_t, std::int32_t>{}; // linked id to position in m.natives
+    for (std::size_t i = 0; i < m.native_ids.size(); ++i) {
+        natives.emplace(std::int32_t(m.native_ids[i]), std::int32_t(i));
+    }
+
+    for (std::size_t pc = 0; pc < m.text.size(); ++pc) {
+        auto instr = m.text[pc];
+        if (instr.OP == CFLOAD || instr.OP == CFCALL) {
+            if (auto iter = natives.find(instr.DI); iter != natives.end()) {
+                instr.DI = iter->second;
+                std::memcpy(text + pc * sizeof(instruction), &instr, sizeof(instr));
+            }
+        }
+    }
+}
+
+}
+
+bool write_module(std::ostream& out, const module& m) {
+    using namespace module_file;
+
+    auto w = image_writer<header>{};
+    std::memcpy(w.hdr.magic, magic, sizeof(magic));
+    w.hdr.version = version;
+    w.hdr.entry_point = m.entry_point;
+    w.hdr.name = w.string(m.name);
+
+    w.begin_section(TEXT);
+    w.bytes(m.text.data(), m.text.size() * sizeof(instruction));
+    w.end_section(TEXT);
+    unlink_import_calls(m, w.out.data() + w.hdr.sections[TEXT].offset);
+    unlink_native_calls(m, w.out.data() + w.hdr.sections[TEXT].offset);
+
+    w.begin_section(DATA);
+    w.bytes(m.data.data(), m.data.size());
+    w.end_section(DATA);
+
+    auto exports = std::vector<export_entry>{};
+    for (const auto& e : m.exports) {
+        exports.push_back({w.string(e.name), e.addr});
+    }
+
+    auto imports = std::vector<import_entry>{};
+    auto symbols = std::vector<symbol_entry>{};
+    for (const auto& imp : m.imports) {
+        imports.push_back({w.string(imp.modname), static_cast<std::uint32_t>(symbols.size()), static_cast<std::uint32_t>(imp.symbols.size())});
+        for (const auto& s : imp.symbols) {
+            symbols.push_back({w.string(s.name), s.addr});
+        }
+    }
+
+    auto natives = std::vector<native_entry>{};
+    for (const auto& n : m.natives) {
+        natives.push_back({w.string(n.name), w.string(n.signature)});
+    }
+
+    w.begin_section(STRINGS);
+    w.bytes(w.strings.data(), w.strings.size());
+    w.end_section(STRINGS);
+
+    w.begin_section(EXPORTS);
+    w.bytes(exports.data(), exports.size() * sizeof(export_entry));
+    w.end_section(EXPORTS);
+
+    w.begin_section(IMPORTS);
+    w.bytes(imports.data(), imports.size() * sizeof(import_entry));
+    w.end_section(IMPORTS);
+
+    w.begin_section(SYMBOLS);
+    w.bytes(symbols.data(), symbols.size() * sizeof(symbol_entry));
+    w.end_section(SYMBOLS);
+
+    w.begin_section(RELOCATIONS);
+    w.bytes(m.relocations.data(), m.relocations.size() * sizeof(relocation));
+    w.end_section(RELOCATIONS);
+
+    w.begin_section(NATIVES);
+    w.bytes(natives.data(), natives.size() * sizeof(native_entry));
+    w.end_section(NATIVES);
+
+    return w.finish(out);
+}
+
+std::optional<module> read_module(const std::string& path, std::string& error) {
+    using namespace module_file;
+
+    auto size = std::size_t{};
+    auto backing = map_file(path, size);
+    if (!backing) {
+        error = "Cannot read module file: " + path;
+        return std::nullopt;
+    }
+    auto r = image_reader{std::move(backing), size};
+
+    auto fail = [&](const std::string& what) {
+        error = "Invalid module file " + path + ": " + what;
+        return std::nullopt;
+    };
+
+    auto hdr = header{};
+    if (!r.value(hdr)) {
+        return fail("truncated header");
+    }
+    if (std::memcmp(hdr.magic, magic, sizeof(magic)) != 0) {
+        return fail("bad magic");
+    }
+    if (hdr.version != version) {
+        return fail("format version " + std::to_string(hdr.version) + ", expected " + std::to_string(version));
+    }
+
+    for (const auto& s : hdr.sections) {
+        if (!r.contains(s)) {
+            return fail("section out of bounds");
+        }
+    }
+
+    r.strings = hdr.sections[STRINGS];
+
+    auto m = module{};
+    m.entry_point = hdr.entry_point;
+
+    if (!r.string(hdr.name, m.name)) {
+        return fail("bad module name");
+    }
+
+    if (!r.borrow(hdr.sections[TEXT], m.text)) {
+        return fail("partial instruction");
+    }
+    r.borrow(hdr.sections[DATA], m.data);
+
+    auto exports = std::vector<export_entry>{};
+    auto imports = std::vector<import_entry>{};
+    auto symbols = std::vector<symbol_entry>{};
+    auto natives = std::vector<native_entry>{};
+    if (!r.table(hdr.sections[EXPORTS], exports) || !r.table(hdr.sections[IMPORTS], imports) ||
+        !r.table(hdr.sections[SYMBOLS], symbols) || !r.table(hdr.sections[RELOCATIONS], m.relocations) ||
+        !r.table(hdr.sections[NATIVES], natives)) {
+        return fail("partial table entry");
+    }
+
+    if (auto problem = read_linkage(r, exports.data(), exports.size(), imports.data(), imports.size(), symbols, m)) {
+        return fail(problem);
+    }
+
+    m.natives.resize(natives.size());
+    for (std::size_t i = 0; i < natives.size(); ++i) {
+        if (!read_native(r, natives[i], m.natives[i])) {
+            return fail("bad native");
+        }
+    }
+
+    return m;
+}
+
+bool write_image(std::ostream& out, const std::vector<module>& modules, std::string& error) {
+    using namespace state_image;
+    using module_file::export_entry;
+    using module_file::import_entry;
+    using module_file::symbol_entry;
+
+    auto w = image_writer<header>{};
+    std::memcpy(w.hdr.magic, magic, sizeof(magic));
+    w.hdr.version = version;
+
+    auto entries = std::vector<module_entry>(modules.size());
+    auto exports = std::vector<export_entry>{};
+    auto imports = std::vector<import_entry>{};
+    auto symbols = std::vector<symbol_entry>{};
+    auto relocations = std::vector<relocation>{};
+    auto native_entries = std::vector<native_entry>{};
+
+    auto range_of = [](std::size_t first, std::size_t count) {
+        return range{static_cast<std::uint32_t>(first), static_cast<std::uint32_t>(count)};
+    };
+
+    for (std::size_t i = 0; i < modules.size(); ++i) {
+        const auto& m = modules[i];
+        auto& e = entries[i];
+        e.name = w.string(m.name);
+        e.entry_point = m.entry_point;
+        e.return_area = m.return_area;
+
+        e.exports = range_of(exports.size(), m.exports.size());
+        for (const auto& x : m.exports) {
+            exports.push_back({w.string(x.name), x.addr});
+        }
+
+        e.imports = range_of(imports.size(), m.imports.size());
+        for (const auto& imp : m.imports) {
+            imports.push_back({w.string(imp.modname), static_cast<std::uint32_t>(symbols.size()), static_cast<std::uint32_t>(imp.symbols.size())});
+            for (const auto& s : imp.symbols) {
+                symbols.push_back({w.string(s.name), s.addr});
+            }
+        }
+
+        e.relocations = range_of(relocations.size(), m.relocations.size());
+        relocations.insert(relocations.end(), m.relocations.begin(), m.relocations.end());
+
+        if (m.native_ids.size() != m.natives.size()) {
+            error = "Module " + m.name + " was not loaded";
+            return false;
+        }
+        e.natives = range_of(native_entries.size(), m.natives.size());
+        for (std::size_t j = 0; j < m.natives.size(); ++j) {
+            native_entries.push_back({{w.string(m.natives[j].name), w.string(m.natives[j].signature)}, m.native_ids[j]});
+        }
+    }
+
+    w.begin_section(TEXT);
+    for (std::size_t i = 0; i < modules.size(); ++i) {
+        entries[i].text = w.block(modules[i].text.data(), modules[i].text.size() * sizeof(instruction));
+    }
+    w.end_section(TEXT);
+
+    w.begin_section(DATA);
+    for (std::size_t i = 0; i < modules.size(); ++i) {
+        entries[i].data = w.block(modules[i].data.data(), modules[i].data.size());
+    }
+    w.end_section(DATA);
+
+    w.begin_section(STRINGS);
+    w.bytes(w.strings.data(), w.strings.size());
+    w.end_section(STRINGS);
+
+    w.begin_section(EXPORTS);
+    w.bytes(exports.data(), exports.size() * sizeof(export_entry));
+    w.end_section(EXPORTS);
+
+    w.begin_section(IMPORTS);
+    w.bytes(imports.data(), imports.size() * sizeof(import_entry));
+    w.end_section(IMPORTS);
+
+    w.begin_section(SYMBOLS);
+    w.bytes(symbols.data(), symbols.size() * sizeof(symbol_entry));
+    w.end_section(SYMBOLS);
+
+    w.begin_section(RELOCATIONS);
+    w.bytes(relocations.data(), relocations.size() * sizeof(relocation));
+    w.end_section(RELOCATIONS);
+
+    w.begin_section(NATIVES);
+    w.bytes(native_entries.data(), native_entries.size() * sizeof(native_entry));
+    w.end_section(NATIVES);
+
+    w.begin_section(MODULES);
+    w.bytes(entries.data(), entries.size() * sizeof(module_entry));
+    w.end_section(MODULES);
+
+    if (!w.finish(out)) {
+        error = "Cannot write state image";
+        return false;
+    }
+    return true;
+}
+
+std::optional<std::vector<module>> read_image(const std::string& path, std::string& error) {
+    using namespace state_image;
+    using module_file::export_entry;
+    using module_file::import_entry;
+    using module_file::symbol_entry;
+
+    auto size = std::size_t{};
+    auto backing = map_file(path, size);
+    if (!backing) {
+        error = "Cannot read state image: " + path;
+        return std::nullopt;
+    }
+    auto r = image_reader{std::move(backing), size};
+
+    auto fail = [&](const std::string& what) {
+        error = "Invalid state image " + path + ": " + what;
+        return std::nullopt;
+    };
+
+    auto hdr = header{};
+    if (!r.value(hdr)) {
+        return fail("truncated header");
+    }
+    if (std::memcmp(hdr.magic, magic, sizeof(magic)) != 0) {
+        return fail("bad magic");
+    }
+    if (hdr.version != version) {
+        return fail("format version " + std::to_string(hdr.version) + ", expected " + std::to_string(version));
+    }
+
+    for (const auto& s : hdr.sections) {
+        if (!r.contains(s)) {
+            return fail("section out of bounds");
+        }
+    }
+
+    r.strings = hdr.sections[STRINGS];
+
+    auto entries = std::vector<module_entry>{};
+    auto exports = std::vector<export_entry>{};
+    auto imports = std::vector<import_entry>{};
+    auto symbols = std::vector<symbol_entry>{};
+    auto relocations = std::vector<relocation>{};
+    auto native_entries = std::vector<native_entry>{};
+    if (!r.table(hdr.sections[MODULES], entries) || !r.table(hdr.sections[EXPORTS], exports) ||
+        !r.table(hdr.sections[IMPORTS], imports) || !r.table(hdr.sections[SYMBOLS], symbols) ||
+        !r.table(hdr.sections[RELOCATIONS], relocations) || !r.table(hdr.sections[NATIVES], native_entries)) {
+        return fail("partial table entry");
+    }
+
+    auto in_bounds = [](range rg, std::size_t size) { return rg.first <= size && size - rg.first >= rg.count; };
+
+    auto modules = std::vector<module>(entries.size());
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        const auto& e = entries[i];
+        auto& m = modules[i];
+        m.entry_point = e.entry_point;
+        m.return_area = e.return_area;
+
+        if (!r.string(e.name, m.name) || !r.borrow(e.text, m.text) || !r.borrow(e.data, m.data) ||
+            !in_bounds(e.exports, exports.size()) || !in_bounds(e.imports, imports.size()) ||
+            !in_bounds(e.relocations, relocations.size()) || !in_bounds(e.natives, native_entries.size())) {
+            return fail("bad module entry");
+        }
+
+        auto first = relocations.begin() + e.relocations.first;
+        m.relocations.assign(first, first + e.relocations.count);
+
+        if (auto problem = read_linkage(r, exports.data() + e.exports.first, e.exports.count,
+                                        imports.data() + e.imports.first, e.imports.count, symbols, m)) {
+            return fail(problem);
+        }
+
+        m.natives.resize(e.natives.count);
+        for (std::uint32_t j = 0; j < e.natives.count; ++j) {
+            const auto& n = native_entries[e.natives.first + j];
+            if (!read_native(r, n.native, m.natives[j])) {
+                return fail("bad native entry");
+            }
+            m.native_ids.push_back(n.id);
+        }
+    }
+
+    return modules;
 }
 
 }
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace moonflower {
+
+// Compiled module files.
+// A header followed by sections, all in host byte order. Every section starts on a 16 byte boundary so text and data
+// are used in place when the file is mapped:
+//   header       magic "MFMD", format version, entry point, module name, offset and size of each section
+//   text         instructions
+//   data         initial data segment
+//   strings      names, referenced by offset and size from the tables below
+//   exports      name and text address of each exported function
+//   imports      module name, first symbol and symbol count of each import
+//   symbols      name and compile-time address of each imported function
+//   relocations  data offsets to fill with the program_addr of an imported function, see relocation
+//   natives      name and signature of each host function the module calls, see native_import
+namespace module_file {
+
+constexpr char magic[4] = {'M', 'F', 'M', 'D'};
+constexpr std::uint32_t version = 5;
+constexpr std::uint32_t alignment = 16;
+
+enum section_id {
+    TEXT,
+    DATA,
+    STRINGS,
+    EXPORTS,
+    IMPORTS,
+    SYMBOLS,
+    RELOCATIONS,
+    NATIVES,
+    SECTION_COUNT,
+};
+
+struct section {
+    std::uint32_t offset;
+    std::uint32_t size; // in bytes
+};
+
+struct string_ref {
+    std::uint32_t offset;
+    std::uint32_t size;
+};
+
+struct header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t entry_point;
+    string_ref name;
+    section sections[SECTION_COUNT];
+};
+
+struct export_entry {
+    string_ref name;
+    std::uint32_t addr;
+};
+
+struct import_entry {
+    string_ref modname;
+    std::uint32_t first_symbol;
+    std::uint32_t symbol_count;
+};
+
+struct symbol_entry {
+    string_ref name;
+    std::uint32_t addr;
+};
+
+struct native_entry {
+    string_ref name;
+    string_ref signature;
+};
+
+}
+
+// State images.
+// Every module of a loaded state, already linked and with its data as it is at the time of writing, so restoring a state
+// compiles, links and verifies nothing. Laid out like module files, with one entry per module indexing into sections
+// the modules share:
+//   header       magic "MFIM", format version, offset and size of each section
+//   text, data   of every module, each starting on a 16 byte boundary so they are used in place
+//   strings, exports, imports, symbols, relocations  as in module files
+//   natives      the host functions each module calls, with the ids its calls were linked to; restoring relinks the
+//                calls whose function has another id in the new state
+//   modules      one module_entry per module, in load order
+namespace state_image {
+
+constexpr char magic[4] = {'M', 'F', 'I', 'M'};
+constexpr std::uint32_t version = 4; // bumped along with module_file::version
+
+enum section_id {
+    MODULES,
+    TEXT,
+    DATA,
+    STRINGS,
+    EXPORTS,
+    IMPORTS,
+    SYMBOLS,
+    RELOCATIONS,
+    NATIVES,
+    SECTION_COUNT,
+};
+
+struct header {
+    char magic[4];
+    std::uint32_t version;
+    module_file::section sections[SECTION_COUNT];
+};
+
+struct range {
+    std::uint32_t first;
+    std::uint32_t count;
+};
+
+struct module_entry {
+    module_file::string_ref name;
+    module_file::section text; // file offset and size of the module's text
+    module_file::section data;
+    range exports;
+    range imports;
+    range relocations;
+    range natives;
+    std::uint32_t entry_point;
+    std::int16_t return_area;
+    std::uint16_t reserved;
+};
+
+struct native_entry {
+    module_file::native_entry native;
+    std::uint32_t id; // in the state the image was written from
+};
+
+}
+
+// Writes `m` as a module file. Returns false if the stream fails.
+bool write_module(std::ostream& out, const module& m);
+
+// Maps a module file into memory; the text and data of the returned module point into the mapping, which lives as long
+// as they do. Imports are left unresolved, see state::load_compiled. Falls back to reading the file when it cannot be
+// mapped. On failure, returns nothing and sets `error`.
+std::optional<module> read_module(const std::string& path, std::string& error);
+
+// Writes `modules` as a state image. On failure, returns false and sets `error`.
+bool write_image(std::ostream& out, const std::vector<module>& modules, std::string& error);
+
+// Maps a state image; text and data point into the mapping, so only the pages that are used get read. The native_ids
+// of each module are those of the state the image was written from, see state::restore_image. On failure, returns
+// nothing and sets `error`.
+std::optional<std::vector<module>> read_image(const std::string& path, std::string& error);
+
+}
@@ -1,12 +1,17 @@
 
+#include "compact_text.hpp"
 #include "interp.hpp"
+#include "source_file.hpp"
 #include "state.hpp"
 #include "scriptparser.hpp"
 
 #include <cstddef>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 #include <chrono>
 
@@ -17,27 +22,30 @@ void print_i(moonflower::state* s, std::byte* stk) {
     std::cout << "  param0 = " << *reinterpret_cast<int*>(stk+8) << std::endl;
 }
 
-template <typename R, typename... Ts>
-void cfunc_to_mf(moonflower::module& m, const std::string& name, R(*func)(Ts...)) {
+// Exports a function that calls the host function registered under `name` and `signature`.
+void cfunc_to_mf(moonflower::module& m, const std::string& name, const std::string& signature) {
     using namespace moonflower;
 
-    auto text_loc = static_cast<std::uint16_t>(m.text.size());
-    auto data_loc = static_cast<std::int16_t>(m.data.size());
-    auto b = reinterpret_cast<const std::byte*>(&func);
-    auto e = b + sizeof(func);
+    auto text_loc = static_cast<std::uint32_t>(m.text.size());
+    auto native = static_cast<std::int32_t>(m.natives.size());
 
-    m.data.insert(m.data.end(), b, e);
+    m.natives.push_back({name, signature});
     m.exports.push_back({name, text_loc});
 
-    m.text.push_back(instruction{opcode::CFCALL, data_loc});
+    m.text.push_back(instruction{opcode::CFCALL, 0, native});
     m.text.push_back(instruction{opcode::RET});
 }
 
+// Host functions are registered before anything that calls them is loaded, state images included.
+void register_core(moonflower::state& S) {
+    S.natives.add("print_i", "void(int)", print_i);
+}
+
 void load_core(moonflower::state& S) {
     using namespace moonflower;
     module m;
     m.name = "print";
-    cfunc_to_mf(m, "print_i", print_i);
+    cfunc_to_mf(m, "print_i", "void(int)");
     S.load(m);
 }
 
@@ -86,6 +94,7 @@ void disass(const moonflower::module& mod) {
 
     int entry_point = mod.entry_point;
     int textsize = mod.text.size();
+    const auto compact = encode_compact(mod);
 
     for (int i = 0; i < textsize; ++i) {
         if (i == entry_point) {
@@ -93,7 +102,7 @@ void disass(const moonflower::module& mod) {
         }
 
         for (const auto& [name, addr] : mod.exports) {
-            if (addr == i) {
+            if (addr == std::uint32_t(i)) {
                 std::cout << name << ":\n";
             }
         }
@@ -109,24 +118,48 @@ void disass(const moonflower::module& mod) {
             case opcode::BSETC: write_ADB0("bsetc", instr); break;
             case opcode::SETADR: write_ADI("setadr", instr); break;
             case opcode::SETDAT: write_ABC("setdat", instr); break;
+            case opcode::SETXADR: write_ABC("setxadr", instr); break;
+            case opcode::SETDATW: write_ADI("setdatw", instr); break;
             case opcode::CPY: write_ABC("cpy", instr); break;
             case opcode::IADD: write_ABC("iadd", instr); break;
             case opcode::ISUB: write_ABC("isub", instr); break;
             case opcode::IMUL: write_ABC("imul", instr); break;
             case opcode::IDIV: write_ABC("idiv", instr); break;
             case opcode::ICLT: write_ABC("iclt", instr); break;
+            case opcode::IMOD: write_ABC("imod", instr); break;
+            case opcode::ISHL: write_ABC("ishl", instr); break;
+            case opcode::ISHR: write_ABC("ishr", instr); break;
+            case opcode::IAND: write_ABC("iand", instr); break;
+            case opcode::IOR: write_ABC("ior", instr); break;
+            case opcode::IXOR: write_ABC("ixor", instr); break;
             case opcode::IADDC: write_ABC("iaddc", instr); break;
             case opcode::ICLTC: write_ABC("icltc", instr); break;
+            case opcode::IMULC: write_ABC("imulc", instr); break;
+            case opcode::IDIVC: write_ABC("idivc", instr); break;
+            case opcode::IMODC: write_ABC("imodc", instr); break;
+            case opcode::ISHLC: write_ABC("ishlc", instr); break;
+            case opcode::ISHRC: write_ABC("ishrc", instr); break;
+            case opcode::IANDC: write_ABC("iandc", instr); break;
+            case opcode::IORC: write_ABC("iorc", instr); break;
+            case opcode::IXORC: write_ABC("ixorc", instr); break;
+            case opcode::ICNEC: write_ABC("icnec", instr); break;
             case opcode::FADD: write_ABC("fadd", instr); break;
             case opcode::FSUB: write_ABC("fsub", instr); break;
             case opcode::FMUL: write_ABC("fmul", instr); break;
             case opcode::FDIV: write_ABC("fdiv", instr); break;
             case opcode::JMP: write_A("jmp", instr); break;
             case opcode::JMPIFN: write_ADI("jmpifn", instr); break;
+            case opcode::JMPTAB: write_ABC("jmptab", instr); break;
+            case opcode::JMPTABW: write_ADI("jmptabw", instr); break;
+            case opcode::FORPREP: write_ADI("forprep", instr); break;
+            case opcode::FORLOOP: write_ADI("forloop", instr); break;
             case opcode::CALL: write_AB("call", instr); break;
             case opcode::RET: write("ret"); break;
-            case opcode::CFLOAD: write_AB("cfload", instr); break;
-            case opcode::CFCALL: write_A("cfcall", instr); break;
+            case opcode::MEMOGET: write_ABC("memoget", instr); break;
+            case opcode::MEMOSET: write_ABC("memoset", instr); break;
+            case opcode::LAZY: write_DI("lazy", instr); break;
+            case opcode::CFLOAD: write_ADI("cfload", instr); break;
+            case opcode::CFCALL: write_DI("cfcall", instr); break;
             case opcode::PFCALL: write_AB("pfcall", instr); break;
             default: write("???"); break;
         }
@@ -141,6 +174,16 @@ void disass(const moonflower::module& mod) {
             std::cout << std::setw(2) << std::to_integer<int>(bytes[i]) << " ";
         }
         std::cout << std::setw(2) << std::to_integer<int>(bytes[7]);
+
+        // the 32-bit form interp runs with state::compact, or "wide" when it escapes to the full instruction
+        std::cout << "  |  ";
+        if ((compact.words[i] & 0xff) == compact::escape) {
+            std::cout << "wide #" << std::setw(4) << (compact.words[i] >> 8);
+        } else {
+            for (auto b = 0; b < 4; ++b) {
+                std::cout << std::setw(2) << ((compact.words[i] >> (8 * b)) & 0xff) << (b < 3 ? " " : "");
+            }
+        }
         std::cout << std::setfill(' ') << std::dec;
 
         std::cout << std::endl;
@@ -149,7 +192,7 @@ void disass(const moonflower::module& mod) {
 
 int main(int argc, char* argv[]) try {
     if (argc < 2) {
-        std::cerr << "usage: moonflower <bytecode_file> [args...]" << std::endl;
+        std::cerr << "usage: moonflower <bytecode_file> [-image <image_file>] [args...]" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -157,25 +200,64 @@ int main(int argc, char* argv[]) try {
 
     const auto A = clock::now();
 
-    std::ifstream file (argv[1], std::ios::binary);
+    // modules written by mfsc are mapped and linked rather than compiled, state images replace the whole setup
+    const auto path = std::string(argv[1]);
+    auto has_extension = [&](const char* ext) {
+        return path.size() > 4 && path.compare(path.size() - 4, 4, ext) == 0;
+    };
+    const auto compiled = has_extension(".mfc");
+    const auto image = has_extension(".mfi");
 
-    if (!file) {
-        std::cerr << "error: file does not exist" << std::endl;
-        return EXIT_FAILURE;
+    std::optional<moonflower::source_file> file;
+
+    if (!compiled && !image) {
+        file.emplace(path);
+        if (!*file) {
+            std::cerr << "error: file does not exist" << std::endl;
+            return EXIT_FAILURE;
+        }
     }
 
     moonflower::state S;
 
-    {
-        moonflower::module m;
-        m.name = "$null";
-        m.text.push_back(moonflower::instruction{moonflower::opcode::TERMINATE, 0});
-        S.load(m);
+    if (auto dir = std::getenv("MOONFLOWER_CACHE")) {
+        S.cache = moonflower::bytecode_cache{dir};
     }
 
-    load_core(S);
+    if (std::getenv("MOONFLOWER_LAZY")) {
+        S.lazy = true;
+    }
+
+    if (std::getenv("MOONFLOWER_COMPACT")) {
+        S.compact = true;
+    }
 
-    auto [mod_idx, messages] = S.load(argv[1], file);
+    register_core(S);
+
+    auto loaded = moonflower::load_result{};
+
+    if (image) {
+        // the script is the last module of the image
+        auto error = std::string{};
+        if (!S.restore_image(path, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        loaded.mod_idx = static_cast<std::int16_t>(S.modules.size() - 1);
+    } else {
+        {
+            moonflower::module m;
+            m.name = "$null";
+            m.text.push_back(moonflower::instruction{moonflower::opcode::TERMINATE, 0});
+            S.load(m);
+        }
+
+        load_core(S);
+
+        loaded = compiled ? S.load_compiled(path) : S.load(path, file->text());
+    }
+
+    auto& [mod_idx, messages, arena_stats] = loaded;
 
     for (const auto& msg : messages) {
         std::clog << msg << std::endl;
@@ -185,6 +267,15 @@ int main(int argc, char* argv[]) try {
         return EXIT_FAILURE;
     }
 
+    if (argc >= 4 && argv[2] == std::string("-image")) {
+        auto out = std::ofstream(argv[3], std::ios::binary);
+        auto error = std::string{};
+        if (!S.save_image(out, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
 #ifdef NDEBUG
     if (argc == 3 && argv[2] == std::string("-dump")) {
         for (auto& mod : S.modules) {
@@ -198,7 +289,7 @@ int main(int argc, char* argv[]) try {
 #endif
 
     S.stacksize = 64 * 1024 * 1024; // 64 MB stack
-    S.stack = std::make_unique<std::byte[]>(S.stacksize);
+    S.stack = std::unique_ptr<std::byte[]>(new std::byte[S.stacksize]); // left uninitialized, so only the pages used are touched
 
     //for (int i = 0; i < argc-2; ++i) {
         //*reinterpret_cast<int*>(&S.stack[12+i*4]) = std::stoi(argv[2+i]);
@@ -242,6 +333,9 @@ int main(int argc, char* argv[]) try {
     print("100 runs", D-C);
     print("total", D-A);
 
+    std::cout << "compile allocations: " << arena_stats.allocations << " (" << arena_stats.bytes << " bytes in " <<
+        arena_stats.blocks << " heap blocks)\n";
+
     return EXIT_SUCCESS;
 } catch (const moonflower_script::parser::syntax_error& e) {
     std::cerr << "Exception: " << e.what() << "(" << e.location << ")" << std::endl;
@@ -0,0 +1,105 @@
+#include "memo_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace moonflower {
+
+namespace {
+
+auto hash_key(std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size) -> std::uint64_t {
+    // FNV-1a
+    auto h = std::uint64_t{14695981039346656037ull};
+    auto add = [&](std::uint8_t b) {
+        h ^= b;
+        h *= 1099511628211ull;
+    };
+    add(mod & 0xff);
+    add(mod >> 8);
+    add(id & 0xff);
+    add(id >> 8);
+    for (std::size_t i = 0; i < key_size; ++i) {
+        add(std::to_integer<std::uint8_t>(key[i]));
+    }
+    return h;
+}
+
+}
+
+memo_cache::memo_cache(std::size_t capacity) {
+    auto size = std::size_t{1};
+    while (size < std::max(capacity, max_probe)) {
+        size *= 2;
+    }
+    entries.resize(size);
+    mask = size - 1;
+}
+
+auto memo_cache::find(std::uint64_t hash, std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size) const -> const entry* {
+    for (std::size_t i = 0; i < max_probe; ++i) {
+        const auto& e = entries[(hash + i) & mask];
+        if (!e.used) {
+            return nullptr;
+        }
+        if (e.hash == hash && e.mod == mod && e.id == id && e.key_size == key_size && std::memcmp(e.key, key, key_size) == 0) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+bool memo_cache::lookup(std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size, std::byte* value, std::size_t value_size) const {
+    if (key_size > max_key_size || value_size > max_value_size) {
+        return false;
+    }
+    auto e = find(hash_key(mod, id, key, key_size), mod, id, key, key_size);
+    if (!e) {
+        return false;
+    }
+    std::memcpy(value, e->value, value_size);
+    return true;
+}
+
+void memo_cache::store(std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size, const std::byte* value, std::size_t value_size) {
+    if (key_size > max_key_size || value_size > max_value_size) {
+        return;
+    }
+
+    auto hash = hash_key(mod, id, key, key_size);
+
+    auto slot = &entries[hash & mask];
+    if (auto e = find(hash, mod, id, key, key_size)) {
+        slot = const_cast<entry*>(e);
+    } else {
+        for (std::size_t i = 0; i < max_probe; ++i) {
+            auto& e = entries[(hash + i) & mask];
+            if (!e.used) {
+                slot = &e;
+                break;
+            }
+        }
+    }
+
+    slot->hash = hash;
+    slot->mod = mod;
+    slot->id = id;
+    slot->key_size = static_cast<std::uint8_t>(key_size);
+    slot->used = true;
+    std::memcpy(slot->key, key, key_size);
+    std::memcpy(slot->value, value, value_size);
+}
+
+void memo_cache::clear() {
+    std::fill(entries.begin(), entries.end(), entry{});
+}
+
+void memo_cache::clear(std::uint16_t mod) {
+    // probes stop at a free slot, so entries past one may be missed until they are overwritten; only costs a miss
+    for (auto& e : entries) {
+        if (e.used && e.mod == mod) {
+            e = entry{};
+        }
+    }
+}
+
+}
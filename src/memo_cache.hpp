@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace moonflower {
+
+// Results of `memo` functions, keyed on the function and the bytes of its arguments.
+// Open addressing with a short linear probe; when every slot in reach is taken, the first one is overwritten, so the
+// cache never grows past its capacity.
+class memo_cache {
+public:
+    static constexpr std::size_t max_key_size = 32;
+    static constexpr std::size_t max_value_size = 16;
+
+    explicit memo_cache(std::size_t capacity = 4096);
+
+    // Copies the cached value into `value` and returns true if there is one.
+    bool lookup(std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size, std::byte* value, std::size_t value_size) const;
+
+    void store(std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size, const std::byte* value, std::size_t value_size);
+
+    void clear();
+
+    // Drops the results of one module's functions, whose bodies may have changed.
+    void clear(std::uint16_t mod);
+
+private:
+    static constexpr std::size_t max_probe = 8;
+
+    struct entry {
+        std::uint64_t hash = 0;
+        std::uint16_t mod = 0;
+        std::uint16_t id = 0;
+        std::uint8_t key_size = 0;
+        bool used = false;
+        std::byte key[max_key_size];
+        std::byte value[max_value_size];
+    };
+
+    auto find(std::uint64_t hash, std::uint16_t mod, std::uint16_t id, const std::byte* key, std::size_t key_size) const -> const entry*;
+
+    std::vector<entry> entries;
+    std::size_t mask;
+};
+
+}
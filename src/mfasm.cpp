@@ -1,6 +1,7 @@
 
 #include "assembler.hpp"
 #include "asmparser.hpp"
+#include "loader.hpp"
 
 #include <cstddef>
 #include <iostream>
@@ -43,23 +44,7 @@ int main(int argc, char* argv[]) try {
             std::cerr << "failed to open file: " << argv[2] << std::endl;
             return EXIT_FAILURE;
         }
-        const auto data = reinterpret_cast<const char*>(tu.m.text.data());
-        const int size = tu.m.text.size();
-
-        ofile.write(reinterpret_cast<const char*>(&tu.m.entry_point), 4);
-        ofile.write(reinterpret_cast<const char*>(&size), 4);
-        ofile.write(data, size * sizeof(moonflower::instruction));
-
-        for (const auto& exp : tu.m.exports) {
-            ofile.write(reinterpret_cast<const char*>(&exp.addr), 4);
-            const int nlen = exp.name.length();
-            ofile.write(reinterpret_cast<const char*>(&nlen), 4);
-            ofile.write(exp.name.data(), nlen);
-        }
-        const auto endexp = -1;
-        ofile.write(reinterpret_cast<const char*>(&endexp), 4);
-
-        if (!ofile) {
+        if (!moonflower::write_module(ofile, tu.m)) {
             std::cerr << "failed to write to file: " << argv[2] << std::endl;
             return EXIT_FAILURE;
         }
@@ -1,10 +1,11 @@
+#include "compact_text.hpp"
+#include "loader.hpp"
 #include "types.hpp"
 
 #include <cstddef>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
-#include <fstream>
 #include <memory>
 #include <vector>
 
@@ -16,10 +17,11 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    std::ifstream file (argv[1], std::ios::binary);
+    auto error = std::string{};
+    auto m = read_module(argv[1], error);
 
-    if (!file) {
-        std::cerr << "error: file does not exist" << std::endl;
+    if (!m) {
+        std::cerr << "error: " << error << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -57,18 +59,31 @@ int main(int argc, char* argv[]) {
         std::cout << std::setw(10) << name << std::setw(cw) << i.A << std::setw(cw*2) << i.DF;
     };
 
-    int entry_point;
-    int textsize;
+    std::cout << "[[" << m->name << "]]\n";
 
-    file.read(reinterpret_cast<char*>(&entry_point), 4);
-    file.read(reinterpret_cast<char*>(&textsize), 4);
+    for (const auto& imp : m->imports) {
+        for (const auto& sym : imp.symbols) {
+            std::cout << "import " << imp.modname << "." << sym.name << "\n";
+        }
+    }
+
+    for (const auto& exp : m->exports) {
+        std::cout << "export " << exp.name << " = " << exp.addr << "\n";
+    }
+
+    for (std::size_t i = 0; i < m->natives.size(); ++i) {
+        std::cout << "native " << i << " = " << m->natives[i].name << " " << m->natives[i].signature << "\n";
+    }
+
+    const int entry_point = m->entry_point;
+    const int textsize = m->text.size();
+    const auto compact = encode_compact(*m);
 
     for (int i = 0; i < textsize; ++i) {
         if (i == entry_point) {
             std::cout << "__MAIN__:\n";
         }
-        instruction instr;
-        file.read(reinterpret_cast<char*>(&instr), sizeof(instruction));
+        instruction instr = m->text[i];
 
         std::cout << std::setw(5) << i << ": ";
 
@@ -77,18 +92,45 @@ int main(int argc, char* argv[]) {
             case opcode::ISETC: write_ADI("isetc", instr); break;
             case opcode::FSETC: write_ADF("fsetc", instr); break;
             case opcode::SETADR: write_ADI("setadr", instr); break;
+            case opcode::SETDAT: write_ABC("setdat", instr); break;
+            case opcode::SETXADR: write_ABC("setxadr", instr); break;
+            case opcode::SETDATW: write_ADI("setdatw", instr); break;
             case opcode::CPY: write_ABC("cpy", instr); break;
             case opcode::IADD: write_ABC("iadd", instr); break;
             case opcode::ISUB: write_ABC("isub", instr); break;
             case opcode::IMUL: write_ABC("imul", instr); break;
             case opcode::IDIV: write_ABC("idiv", instr); break;
+            case opcode::IMOD: write_ABC("imod", instr); break;
+            case opcode::ISHL: write_ABC("ishl", instr); break;
+            case opcode::ISHR: write_ABC("ishr", instr); break;
+            case opcode::IAND: write_ABC("iand", instr); break;
+            case opcode::IOR: write_ABC("ior", instr); break;
+            case opcode::IXOR: write_ABC("ixor", instr); break;
+            case opcode::IMULC: write_ABC("imulc", instr); break;
+            case opcode::IDIVC: write_ABC("idivc", instr); break;
+            case opcode::IMODC: write_ABC("imodc", instr); break;
+            case opcode::ISHLC: write_ABC("ishlc", instr); break;
+            case opcode::ISHRC: write_ABC("ishrc", instr); break;
+            case opcode::IANDC: write_ABC("iandc", instr); break;
+            case opcode::IORC: write_ABC("iorc", instr); break;
+            case opcode::IXORC: write_ABC("ixorc", instr); break;
+            case opcode::ICNEC: write_ABC("icnec", instr); break;
             case opcode::FADD: write_ABC("fadd", instr); break;
             case opcode::FSUB: write_ABC("fsub", instr); break;
             case opcode::FMUL: write_ABC("fmul", instr); break;
             case opcode::FDIV: write_ABC("fdiv", instr); break;
             case opcode::JMP: write_A("jmp", instr); break;
+            case opcode::JMPTAB: write_ABC("jmptab", instr); break;
+            case opcode::JMPTABW: write_ADI("jmptabw", instr); break;
+            case opcode::FORPREP: write_ADI("forprep", instr); break;
+            case opcode::FORLOOP: write_ADI("forloop", instr); break;
             case opcode::CALL: write_AB("call", instr); break;
             case opcode::RET: write("ret"); break;
+            case opcode::MEMOGET: write_ABC("memoget", instr); break;
+            case opcode::MEMOSET: write_ABC("memoset", instr); break;
+            case opcode::LAZY: write_DI("lazy", instr); break;
+            case opcode::CFLOAD: write_ADI("cfload", instr); break;
+            case opcode::CFCALL: write_DI("cfcall", instr); break;
             default: write("???"); break;
         }
 
@@ -102,6 +144,16 @@ int main(int argc, char* argv[]) {
             std::cout << std::setw(2) << std::to_integer<int>(bytes[i]) << " ";
         }
         std::cout << std::setw(2) << std::to_integer<int>(bytes[7]);
+
+        // the 32-bit form interp runs with state::compact, or "wide" when it escapes to the full instruction
+        std::cout << "  |  ";
+        if ((compact.words[i] & 0xff) == compact::escape) {
+            std::cout << "wide #" << std::setw(4) << (compact.words[i] >> 8);
+        } else {
+            for (auto b = 0; b < 4; ++b) {
+                std::cout << std::setw(2) << ((compact.words[i] >> (8 * b)) & 0xff) << (b < 3 ? " " : "");
+            }
+        }
         std::cout << std::setfill(' ') << std::dec;
 
         std::cout << std::endl;
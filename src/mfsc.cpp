@@ -1,47 +1,67 @@
-
-#include "scriptlexer.hpp"
-#include "scriptparser.hpp"
-#include "script_context.hpp"
+#include "build.hpp"
+#include "loader.hpp"
+#include "state.hpp"
 #include "types.hpp"
 
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <string>
+#include <vector>
 
-int main(int argc, char* argv[]) try {
-    if (argc != 3) {
-        std::cerr << "usage: mfasm <source> <out>" << std::endl;
-        return EXIT_FAILURE;
+namespace {
+
+bool write_file(const moonflower::module& m, const std::string& path) {
+    auto ofile = std::ofstream(path, std::ios::binary);
+    if (!ofile) {
+        std::cerr << "failed to open file: " << path << std::endl;
+        return false;
+    }
+    if (!moonflower::write_module(ofile, m)) {
+        std::cerr << "failed to write to file: " << path << std::endl;
+        return false;
     }
+    return true;
+}
 
-    auto ss = std::stringstream{};
+}
 
-    {
-        auto ifile = std::ifstream(argv[1]);
-        if (!ifile) {
-            std::cerr << "failed to open file: " << argv[1] << std::endl;
-            return EXIT_FAILURE;
+int main(int argc, char* argv[]) try {
+    auto threads = 0u;
+    auto args = std::vector<std::string>{};
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string(argv[i]);
+        if (arg == "-j" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (arg.rfind("-j", 0) == 0 && arg.size() > 2) {
+            threads = std::stoul(arg.substr(2));
+        } else {
+            args.push_back(std::move(arg));
         }
-
-        ss << ifile.rdbuf();
     }
 
-    auto source = ss.str();
-
-    auto context = moonflower::script_context{};
-    context.program.push_back(moonflower::instruction{moonflower::TERMINATE});
+    if (args.size() < 2) {
+        std::cerr << "usage: mfsc [-j N] <source> <out>" << std::endl;
+        std::cerr << "       mfsc [-j N] <source>... <outdir>" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    auto lexer = moonflower_script::lexer{source};
-    auto parser = moonflower_script::parser{lexer, context};
+    const auto out = args.back();
+    args.pop_back();
 
-    //parser.set_debug_level(1);
+    auto S = moonflower::state{};
+    auto results = moonflower::build(S, args, threads);
 
-    bool success = parser.parse() == 0;
+    bool success = true;
 
-    for (const auto& msg : context.messages) {
-        std::clog << msg << std::endl;
-        if (msg.severity == moonflower::compile_message::ERROR) {
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        for (const auto& msg : results[i].messages) {
+            std::clog << args[i] << ": " << msg << std::endl;
+        }
+        if (!results[i].mod_idx) {
             success = false;
         }
     }
@@ -50,41 +70,14 @@ int main(int argc, char* argv[]) try {
         return EXIT_FAILURE;
     }
 
-    {
-        auto ofile = std::ofstream(argv[2], std::ios::binary);
-        if (!ofile) {
-            std::cerr << "failed to open file: " << argv[2] << std::endl;
-            return EXIT_FAILURE;
-        }
-        const auto data = reinterpret_cast<const char*>(context.program.data());
-        const int size = context.program.size();
-        const int entry_point = context.main_entry;
-
-        ofile.write(reinterpret_cast<const char*>(&entry_point), 4);
-        ofile.write(reinterpret_cast<const char*>(&size), 4);
-        ofile.write(data, size * sizeof(moonflower::instruction));
-
-        /*
-        for (const auto& exp : tu.m.exports) {
-            ofile.write(reinterpret_cast<const char*>(&exp.addr), 4);
-            const int nlen = exp.name.length();
-            ofile.write(reinterpret_cast<const char*>(&nlen), 4);
-            ofile.write(exp.name.data(), nlen);
-        }
-        */
-        const auto endexp = -1;
-        ofile.write(reinterpret_cast<const char*>(&endexp), 4);
-
-        if (!ofile) {
-            std::cerr << "failed to write to file: " << argv[2] << std::endl;
+    for (const auto& r : results) {
+        const auto path = args.size() == 1 ? out : out + "/" + r.name + ".mfc";
+        if (!write_file(S.modules[*r.mod_idx], path)) {
             return EXIT_FAILURE;
         }
     }
 
     return EXIT_SUCCESS;
-} catch (const moonflower_script::parser::syntax_error& e) {
-    std::cerr << "Exception: " << e.what() << "(" << e.location << ")" << std::endl;
-    return EXIT_FAILURE;
 } catch (const std::exception& e) {
     std::cerr << "Exception: " << e.what() << std::endl;
     return EXIT_FAILURE;
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace moonflower {
+
+// The host functions a state's modules can call. Modules name the functions they call, see native_import, so compiled
+// modules and state images hold no pointers and can be reused by another process; loading a module links each name
+// and signature to the id of a function added here. Ids are dense, so CFCALL costs one indexed load from table().
+// Functions must not be added while a script is running.
+class native_registry {
+public:
+    // Adds a function, or rebinds the one already added with this name and signature. Returns its id.
+    std::uint32_t add(const std::string& name, const std::string& signature, cfunc* func) {
+        auto [iter, inserted] = index.try_emplace(key(name, signature), static_cast<std::uint32_t>(funcs.size()));
+        if (inserted) {
+            funcs.push_back(func);
+        } else {
+            funcs[iter->second] = func;
+        }
+        return iter->second;
+    }
+
+    std::optional<std::uint32_t> find(std::string_view name, std::string_view signature) const {
+        auto iter = index.find(key(name, signature));
+        if (iter == index.end()) {
+            return std::nullopt;
+        }
+        return iter->second;
+    }
+
+    cfunc* const* table() const { return funcs.data(); }
+
+    std::size_t size() const { return funcs.size(); }
+
+private:
+    static std::string key(std::string_view name, std::string_view signature) {
+        auto k = std::string(name);
+        k += '\0';
+        k += signature;
+        return k;
+    }
+
+    std::vector<cfunc*> funcs;
+    std::unordered_map<std::string, std::uint32_t> index;
+};
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace moonflower {
+
+// Runs body(i) for every i in [0, count) on up to `threads` threads, 0 meaning one per core.
+// The calling thread takes part, so with one thread everything runs inline. The first exception thrown by a body is
+// rethrown once every thread has stopped.
+template <typename F>
+void parallel_for(std::size_t count, unsigned threads, F&& body) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<std::size_t>(threads, count));
+
+    if (threads <= 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    auto next = std::atomic<std::size_t>{0};
+    auto error = std::exception_ptr{};
+    auto error_mutex = std::mutex{};
+
+    auto work = [&] {
+        for (auto i = next++; i < count; i = next++) {
+            try {
+                body(i);
+            } catch (...) {
+                auto lock = std::lock_guard(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        }
+    };
+
+    auto pool = std::vector<std::thread>{};
+    pool.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& t : pool) {
+        t.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}
@@ -1,98 +1,310 @@
 #include "script_context.hpp"
 
+#include "compact_text.hpp"
+#include "frame_layout.hpp"
+#include "ir.hpp"
+#include "parallel.hpp"
 #include "state.hpp"
 
+#include <algorithm>
 #include <cstddef>
+#include <limits>
+#include <optional>
+#include <utility>
 
 namespace moonflower {
 
-script_context::script_context(state& S) : S(&S) {
-    nulltype = std::make_shared<type>(type::nothing{});
+namespace {
+
+// Appends a jump table for the JMPTAB at offset `jmptab` of its function, returns its data address if it fits.
+template <typename Data>
+auto append_jump_table(Data& data, const jump_table& table, int jmptab) -> std::optional<std::int32_t> {
+    while (data.size() % alignof(std::int32_t) != 0) {
+        data.push_back(std::byte{0});
+    }
+    auto append = [&](std::int32_t value) {
+        auto bytes = reinterpret_cast<const std::byte*>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(value));
+    };
+    append(static_cast<std::int32_t>(table.targets.size()));
+    auto addr = data.size();
+    append(table.low);
+    for (auto target : table.targets) {
+        append(target - jmptab - 1);
+    }
+    if (data.size() > std::size_t(std::numeric_limits<std::int32_t>::max())) {
+        return std::nullopt;
+    }
+    return static_cast<std::int32_t>(addr);
 }
 
-type::usertype& script_context::new_usertype(const std::string& name) {
-    auto t = std::make_shared<type>(type::usertype{});
-    global_types[name] = t;
-    return std::get<type::usertype>(t->t);
+// Points a JMPTAB at its table, as a JMPTABW if the table lies past the reach of B.
+void set_jump_table(instruction& instr, std::int32_t addr) {
+    if (addr <= std::numeric_limits<std::int16_t>::max()) {
+        instr.BC.B = static_cast<std::int16_t>(addr);
+    } else {
+        instr = instruction{opcode::JMPTABW, instr.A, addr};
+    }
 }
 
+}
+
+script_context::script_context(state& S) : S(&S) {}
+
 type_ptr script_context::get_global_type(const std::string& name) {
-    auto iter = global_types.find(name);
-    if (iter != end(global_types)) {
-        return iter->second;
+    if (auto t = S->types.global(name)) {
+        return t;
     } else {
         messages.emplace_back("Type does not exist: " + name, location{});
-        return nulltype;
+        return S->types.nothing();
     }
 }
 
-void script_context::begin_import(const std::string& module_name) {
-    for (std::uint16_t mi = 0; mi < S->modules.size(); ++mi) {
-        auto& m = S->modules[mi];
-        if (m.name == module_name) {
-            current_import_module = mi;
-            return;
-        }
+type_ptr script_context::get_global_type(symbol_id name) {
+    return get_global_type(std::string(symbols.name(name)));
+}
+
+void script_context::begin_import(symbol_id module_name) {
+    auto name = symbols.name(module_name);
+    current_import_module = S->find_module(name);
+    imports.push_back({std::string(name), {}});
+    if (!current_import_module) {
+        messages.emplace_back("Module not loaded: " + std::string(name), location{});
     }
-    current_import_module = std::nullopt;
-    messages.emplace_back("Module not loaded: " + module_name, location{});
 }
 
-void script_context::import(const std::string& func_name) {
+void script_context::import(symbol_id func_name) {
     if (current_import_module) {
-        auto& m = S->modules[*current_import_module];
-        for (const auto& e : m.exports) {
-            if (e.name == func_name) {
-                auto adr = program_addr{
-                    *current_import_module,
-                    e.addr,
-                };
-                auto type = make_type_ptr(type::function_ptr{make_type_ptr(type::nothing{}), {}});
-                static_scope.insert_or_assign(func_name, object{addresses::data{static_cast<std::int16_t>(data.size())}, type});
-                auto adr_bytes = reinterpret_cast<std::byte*>(&adr);
-                data.insert(data.end(), adr_bytes, adr_bytes + sizeof(adr));
-            }
+        if (auto e = S->find_export(*current_import_module, symbols.name(func_name))) {
+            auto& imp = imports.back();
+            relocations.push_back({
+                static_cast<std::uint32_t>(data.size()),
+                static_cast<std::uint16_t>(imports.size() - 1),
+                static_cast<std::uint16_t>(imp.symbols.size()),
+            });
+            imp.symbols.push_back(*e);
+            auto adr = program_addr{
+                e->addr,
+                *current_import_module,
+            };
+            auto type = S->types.function_ptr({S->types.nothing(), {}});
+            static_scope.insert_or_assign(func_name, object{addresses::data{static_cast<std::int32_t>(data.size())}, type});
+            auto adr_bytes = reinterpret_cast<std::byte*>(&adr);
+            data.insert(data.end(), adr_bytes, adr_bytes + sizeof(adr));
         }
     }
 }
 
-void script_context::begin_func(const std::string& name, const location& loc) {
-    cur_func = {name};
-    cur_func.type = make_type_ptr(type::function{});
-    static_scope[name] = object{addresses::global{-1}, cur_func.type};
-    add_local("?retaddr", get_global_type("int"), loc);
-    add_local("?retstack", get_global_type("int"), loc);
+void script_context::begin_func(symbol_id name, const location& loc) {
+    cur_func = function_context{name, &arena};
+    cur_func.index = static_cast<int>(bodies.size());
+    add_local(symbols.intern("?retaddr"), get_global_type("int"), loc);
+    add_local(symbols.intern("?retstack"), get_global_type("int"), loc);
 }
 
 void script_context::end_func() {
-    auto entry = std::int16_t(program.size());
+    cur_func.frame_top = get_aligned_top(1, true);
+    bodies.push_back(std::move(cur_func));
+}
+
+void script_context::export_func() {
+    bodies.back().exported = true;
+}
+
+void script_context::link_functions() {
+    if (S->lazy) {
+        stub_functions();
+        return;
+    }
+
+    // bodies only refer to each other by function index, so they can be laid out and optimized independently
+    parallel_for(bodies.size(), compile_threads, [&](std::size_t i) {
+        layout_frame(bodies[i], bodies[i].frame_top);
+        ir::optimize(bodies[i]);
+    });
+
+    auto entries = std::vector<std::int32_t>(bodies.size());
+    auto next = program.size();
+    for (std::size_t i = 0; i < bodies.size(); ++i) {
+        entries[i] = static_cast<std::int32_t>(next);
+        next += bodies[i].text.size();
+    }
+
+    for (const auto& func : bodies) {
+        auto entry = static_cast<std::int32_t>(program.size());
+
+        if (symbols.name(func.name) == "main") {
+            main_entry = entry;
+        }
+
+        if (func.exported) {
+            exports.push_back({std::string(symbols.name(func.name)), static_cast<std::uint32_t>(entry)});
+        }
+
+        for (auto instr : func.text) {
+            // address fixups go here
+            switch (instr.OP) {
+                case opcode::SETADR:
+                    instr.DI = entries[instr.DI];
+                    break;
+                case opcode::JMPTAB:
+                    set_jump_table(instr, add_jump_table(func.jump_tables[instr.BC.B], static_cast<int>(program.size()) - entry));
+                    break;
+            }
+            program.push_back(instr);
+        }
+
+        functions.push_back({std::string(symbols.name(func.name)), entry, static_cast<int>(program.size())});
+    }
+
+    bodies.clear();
+}
+
+void script_context::stub_functions() {
+    pending = std::make_shared<pending_functions>();
+
+    for (std::size_t i = 0; i < bodies.size(); ++i) {
+        auto& func = bodies[i];
+        auto stub = static_cast<std::int32_t>(program.size());
+
+        if (symbols.name(func.name) == "main") {
+            main_entry = stub;
+        }
+
+        if (func.exported) {
+            exports.push_back({std::string(symbols.name(func.name)), static_cast<std::uint32_t>(stub)});
+        }
 
-    if (cur_func.name == "main") {
-        main_entry = entry;
+        program.push_back(instruction{opcode::LAZY, 0, static_cast<std::int32_t>(i)});
+        functions.push_back({std::string(symbols.name(func.name)), stub, stub + 1});
+
+        // the arena goes away with the context, so the body keeps only what linking needs
+        auto& body = pending->bodies.emplace_back();
+        body.frame_top = func.frame_top;
+        body.text = std::move(func.text);
+        body.call_sites = std::move(func.call_sites);
+        body.jump_tables = std::move(func.jump_tables);
+        pending->stubs.push_back(stub);
     }
 
-    static_scope[cur_func.name] = {addresses::global{entry}, cur_func.type};
+    pending->entries = pending->stubs;
+    pending->callers.resize(bodies.size());
+    bodies.clear();
+}
+
+bool compile_pending(module& m, int index) {
+    auto& pending = *m.pending;
+
+    // the body stays pending until it fits, so a failed call can be retried
+    auto func = pending.bodies[index];
+    layout_frame(func, func.frame_top);
+    ir::optimize(func);
 
-    for (auto instr : cur_func.text) {
-        // address fixups go here
+    auto entry = static_cast<int>(m.text.size());
+    if (entry + func.text.size() > std::size_t(std::numeric_limits<std::int32_t>::max())) {
+        return false;
+    }
+
+    const auto data_size = m.data.size();
+    auto text = std::vector<instruction>{};
+    auto callers = std::vector<std::pair<std::int32_t, int>>{}; // function index and the pc of its SETADR
+    text.reserve(func.text.size());
+    for (auto instr : func.text) {
+        auto pc = entry + static_cast<int>(text.size());
         switch (instr.OP) {
             case opcode::SETADR:
-                if (instr.DI == -1) {
-                    instr.DI = entry;
+                if (pending.entries[instr.DI] == pending.stubs[instr.DI]) {
+                    callers.emplace_back(instr.DI, pc);
+                }
+                instr.DI = pending.entries[instr.DI];
+                break;
+            case opcode::JMPTAB:
+                if (auto addr = append_jump_table(m.data, func.jump_tables[instr.BC.B], pc - entry)) {
+                    set_jump_table(instr, *addr);
+                } else {
+                    m.data.resize(data_size);
+                    return false;
                 }
                 break;
         }
-        program.push_back(instr);
+        text.push_back(instr);
+    }
+
+    pending.bodies[index] = {};
+    for (auto [callee, pc] : callers) {
+        pending.callers[callee].push_back(pc);
+    }
+    m.text.insert(m.text.end(), text.begin(), text.end());
+
+    auto stub = pending.stubs[index];
+    pending.entries[index] = static_cast<std::int32_t>(entry);
+    m.text[stub] = instruction{opcode::JMP, 0, static_cast<std::int32_t>(entry - stub - 1)};
+    update_compact(m, entry, m.text.size());
+    update_compact(m, stub, stub + 1);
+    for (auto pc : std::exchange(pending.callers[index], {})) {
+        m.text[pc].DI = entry;
+        update_compact(m, pc, pc + 1);
     }
+    return true;
 }
 
-void script_context::add_param(const std::string& name, const type_ptr& type, const location& loc) {
+void script_context::add_param(symbol_id name, const type_ptr& type, const location& loc) {
     add_local(name, type, loc);
-    std::get<type::function>(cur_func.type->t).params.push_back(type);
+    cur_func.signature.params.push_back(type);
 }
 
 void script_context::set_return_type(const type_ptr& type, const location& loc) {
-    std::get<type::function>(cur_func.type->t).ret_type = type;
+    cur_func.signature.ret_type = type;
+    cur_func.type = S->types.function(cur_func.signature);
+    static_scope[cur_func.name] = object{addresses::global{static_cast<std::int16_t>(cur_func.index)}, cur_func.type};
+    if (cur_func.memo) {
+        emit_memo_lookup(loc);
+    }
+}
+
+void script_context::set_memo() {
+    cur_func.memo = true;
+}
+
+void script_context::emit_memo_lookup(const location& loc) {
+    const auto& func = cur_func.signature;
+
+    for (const auto& param : func.params) {
+        if (!std::holds_alternative<type::usertype>(param->t)) {
+            messages.emplace_back("Memo function parameters must be scalars", loc);
+        }
+    }
+
+    // the key is every byte from the first parameter up to the end of the last one
+    constexpr auto linkage = 2; // ?retaddr and ?retstack
+    auto end = get_aligned_top(1, true);
+    auto begin = func.params.empty() ? end : cur_func.local_stack[linkage].obj.addr.value;
+    auto ret_size = value_size(func.ret_type);
+
+    // callers only write the parameters, the alignment holes between them would make equal calls miss
+    auto hole = begin;
+    for (std::size_t i = 0; i < func.params.size(); ++i) {
+        const auto& param = cur_func.local_stack[linkage + i].obj;
+        for (; hole < param.addr.value; ++hole) {
+            emit({opcode::BSETC, hole, false});
+        }
+        hole = param.addr.value + value_size(param.t);
+    }
+
+    if (static_cast<std::size_t>(end - begin) > memo_cache::max_key_size) {
+        messages.emplace_back("Memo function parameters are too large", loc);
+    }
+    if (static_cast<std::size_t>(ret_size) > memo_cache::max_value_size) {
+        messages.emplace_back("Memo function return value is too large", loc);
+    }
+
+    auto id = static_cast<std::int16_t>(memo_count++);
+    auto lookup = instruction{opcode::MEMOGET, begin, {static_cast<std::int16_t>(end - begin), id}};
+    lookup.R = static_cast<std::uint8_t>(ret_size);
+    emit(lookup);
+
+    cur_func.memo_store = lookup;
+    cur_func.memo_store.OP = opcode::MEMOSET;
 }
 
 auto script_context::get_aligned_top(std::int16_t align, bool exclude_expr) -> std::int16_t {
@@ -110,26 +322,44 @@ auto script_context::get_aligned_top(std::int16_t align, bool exclude_expr) -> s
     return top;
 }
 
-auto script_context::add_local(const std::string& name, const type_ptr& t, const location& loc) -> const stack_object& {
+auto script_context::add_local(symbol_id name, const type_ptr& t, const location& loc) -> const stack_object& {
     push_object(t, loc);
     promote_local(name, loc);
     return cur_func.local_stack.back().obj;
 }
 
-void script_context::promote_local(const std::string& name, const location& loc) {
+void script_context::promote_local(symbol_id name, const location& loc) {
     if (cur_func.expr_stack.size() != 1) {
         messages.emplace_back("Only one object must be on the stack to promote", loc);
         pop_objects_until(1);
     }
     cur_func.local_stack.emplace_back(name, std::move(cur_func.expr_stack.back()));
     cur_func.expr_stack.pop_back();
+    bind_local(static_cast<int>(cur_func.local_stack.size()) - 1, name);
+}
+
+void script_context::bind_local(int index, symbol_id name) {
+    auto& var = cur_func.local_stack[index];
+    auto [iter, inserted] = cur_func.bindings.try_emplace(name, index);
+    var.name = name;
+    var.shadowed = inserted ? -1 : iter->second;
+    iter->second = index;
+}
+
+void script_context::pop_local() {
+    const auto& var = cur_func.local_stack.back();
+    if (var.shadowed < 0) {
+        cur_func.bindings.erase(var.name);
+    } else {
+        cur_func.bindings[var.name] = var.shadowed;
+    }
+    cur_func.local_stack.pop_back();
 }
 
 auto script_context::push_object(const type_ptr& t, const location& loc) -> const stack_object& {
     auto top = get_aligned_top(value_align(t), false);
     cur_func.expr_stack.push_back({addresses::local{top}, t});
-    top += value_size(t);
-    if (top > stack_max) {
+    if (int(top) + value_size(t) > stack_max) {
         messages.emplace_back("Stack overflow", loc);
     }
     return cur_func.expr_stack.back();
@@ -163,20 +393,20 @@ std::int16_t script_context::get_return_value_offset(const type_ptr& t) {
 }
 
 stack_object script_context::get_return_object() {
-    auto t = std::get<type::function>(cur_func.type->t).ret_type;
+    auto t = cur_func.signature.ret_type;
     return {{get_return_value_offset(t)}, t};
 }
 
-std::optional<stack_object> script_context::stack_lookup(const std::string& name) {
-    for (const auto& var : cur_func.local_stack) {
-        if (var.name == name) {
-            return var.obj;
-        }
+std::optional<stack_object> script_context::stack_lookup(symbol_id name) {
+    auto iter = cur_func.bindings.find(name);
+    if (iter != cur_func.bindings.end()) {
+        return cur_func.local_stack[iter->second].obj;
+    } else {
+        return std::nullopt;
     }
-    return std::nullopt;
 }
 
-std::optional<object> script_context::static_lookup(const std::string& name) {
+std::optional<object> script_context::static_lookup(symbol_id name) {
     auto iter = static_scope.find(name);
     if (iter != end(static_scope)) {
         return iter->second;
@@ -185,7 +415,7 @@ std::optional<object> script_context::static_lookup(const std::string& name) {
     }
 }
 
-int script_context::expr_id(const std::string& name, const location& loc) {
+int script_context::expr_id(symbol_id name, const location& loc) {
     if (auto idx = stack_lookup(name)) {
         push_expr({expression::stack_id{idx->addr.value}, idx->t, category::OBJECT});
     } else if (auto idx = static_lookup(name)) {
@@ -193,7 +423,7 @@ int script_context::expr_id(const std::string& name, const location& loc) {
             [&](const type::function& func) {
                 std::visit(overload{
                     [&](const addresses::global& g){
-                        push_expr({expression::function{g.value}, std::make_shared<type>(type::function_ptr{func}), category::EXPIRING});
+                        push_expr({expression::function{g.value}, S->types.function_ptr(func), category::EXPIRING});
                     },
                     [&](const addresses::data& d){
                         throw std::runtime_error("Not yet implemented");
@@ -203,13 +433,13 @@ int script_context::expr_id(const std::string& name, const location& loc) {
                     },
                 }, idx->addr);
             },
-            [&](const type::function_ptr& func_ptr) {
+            [&](const type::function_ptr&) {
                 std::visit(overload{
                     [&](const addresses::global&){
                         throw std::runtime_error("Not yet implemented");
                     },
                     [&](const addresses::data& d){
-                        push_expr({expression::imported_function{d.value}, make_type_ptr(func_ptr), category::OBJECT});
+                        push_expr({expression::imported_function{d.value}, idx->t, category::OBJECT});
                     },
                     [&](const addresses::local&){
                         throw std::runtime_error("Not yet implemented");
@@ -217,13 +447,13 @@ int script_context::expr_id(const std::string& name, const location& loc) {
                 }, idx->addr);
             },
             [&](const auto&) {
-                push_expr({expression::nothing{}, make_type_ptr(type::nothing{}), category::OBJECT});
-                messages.emplace_back("Static name is not a function: " + name, loc);
+                push_expr({expression::nothing{}, S->types.nothing(), category::OBJECT});
+                messages.emplace_back("Static name is not a function: " + std::string(symbols.name(name)), loc);
             }
         }, idx->t->t);
     } else {
-        push_expr({expression::nothing{}, make_type_ptr(type::nothing{}), category::OBJECT});
-        messages.emplace_back("Could not find name: " + name, loc);
+        push_expr({expression::nothing{}, S->types.nothing(), category::OBJECT});
+        messages.emplace_back("Could not find name: " + std::string(symbols.name(name)), loc);
     }
 
     return 1;
@@ -242,60 +472,38 @@ int script_context::expr_const_bool(bool val) {
 int script_context::expr_binop(binop op, int lhs_size, int rhs_size, const location& loc) {
     auto lhs = *(rbegin(cur_func.active_exprs) + rhs_size);
     auto rhs = *rbegin(cur_func.active_exprs);
+    auto size = lhs_size + rhs_size + 1;
 
     std::visit(overload {
         [&](const type::usertype& lhs_ut) {
             auto iter = lhs_ut.binops.find(op);
             if (iter == end(lhs_ut.binops)) {
-                push_expr({expression::nothing{}, make_type_ptr(type::nothing{}), category::OBJECT});
+                push_expr({expression::nothing{}, S->types.nothing(), category::OBJECT, size});
                 messages.emplace_back("LHS does not have operator", loc);
             } else {
                 auto overload_op = std::find_if(begin(iter->second), end(iter->second), [&](const auto& def) {
-                    return *def.rhs_type == *rhs.type;
+                    return def.rhs_type == rhs.type;
                 });
 
                 if (overload_op == end(iter->second)) {
-                    push_expr({expression::nothing{}, make_type_ptr(type::nothing{}), category::OBJECT});
+                    push_expr({expression::nothing{}, S->types.nothing(), category::OBJECT, size});
                     messages.emplace_back("No suitable overload", loc);
                 } else {
-                    push_expr({expression::binary{{lhs.type, &*overload_op}}, overload_op->return_type, category::EXPIRING});
+                    push_expr({expression::binary{&*overload_op}, overload_op->return_type, category::EXPIRING, size});
                 }
             }
         },
         [&](const auto&) {
-            push_expr({expression::nothing{}, make_type_ptr(type::nothing{}), category::OBJECT});
+            push_expr({expression::nothing{}, S->types.nothing(), category::OBJECT, size});
             messages.emplace_back("No suitable operation (LHS type is `" + to_string(lhs.type) + "`)", loc);
         }
     }, lhs.type->t);
 
-    return lhs_size + rhs_size + 1;
+    return size;
 }
 
 int script_context::get_expr_size(int loc) const {
-    auto iter = rbegin(cur_func.active_exprs) + loc;
-    const auto& expr = *iter;
-
-    return 1 + std::visit(overload {
-        [](expression::nothing) { return 0; },
-        [](expression::stack_id) { return 0; },
-        [](expression::function) { return 0; },
-        [](expression::imported_function) { return 0; },
-        [](expression::constant) { return 0; },
-        [&](const expression::binary& e) {
-            const auto rhs_size = get_expr_size(loc + 1);
-            const auto lhs_size = get_expr_size(loc + 1 + rhs_size);
-            return rhs_size + lhs_size;
-        },
-        [&](const expression::call& c) {
-            auto size = 0;
-            for (int i = 0; i < c.nargs; ++i) {
-                size += get_expr_size(loc + 1 + size);
-            }
-            size += get_expr_size(loc + 1 + size);
-            return size;
-        },
-        [&](const expression::dataload& dl) { return 0; },
-    }, expr.expr);
+    return (rbegin(cur_func.active_exprs) + loc)->size;
 }
 
 int script_context::expr_call(int nargs, const location& loc) {
@@ -307,29 +515,44 @@ int script_context::expr_call(int nargs, const location& loc) {
     expr_size += get_expr_size(expr_size);
     std::visit(overload {
         [&](const type::function_ptr& func) {
-            push_expr({expression::call{nargs}, func.base.ret_type, category::EXPIRING});
+            push_expr({expression::call{nargs}, func.base.ret_type, category::EXPIRING, expr_size + 1});
         },
         [&](const auto&) {
             cur_func.active_exprs.resize(cur_func.active_exprs.size() - expr_size);
-            push_expr({expression::nothing{}, make_type_ptr(type::nothing{}), category::OBJECT});
+            push_expr({expression::nothing{}, S->types.nothing(), category::OBJECT});
             messages.emplace_back("Called object is not callable", loc);
         }
     }, funcexpr.type->t);
-    return expr_size + 1;
+    return cur_func.active_exprs.back().size;
 }
 
-std::int16_t script_context::emit(const instruction& instr) {
+int script_context::emit(const instruction& instr) {
     auto ret = cur_func.text.size();
     cur_func.text.push_back(instr);
-    return static_cast<std::int16_t>(ret);
+    return static_cast<int>(ret);
+}
+
+void script_context::emit_data_load(std::int16_t dest, std::int32_t addr, std::int16_t size) {
+    if (addr <= std::numeric_limits<std::int16_t>::max()) {
+        emit({opcode::SETDAT, dest, {static_cast<std::int16_t>(addr), size}});
+        return;
+    }
+    // R holds the size, so larger values are loaded in pieces
+    constexpr int max_piece = std::numeric_limits<std::uint8_t>::max();
+    for (int done = 0; done < size; done += max_piece) {
+        auto instr = instruction{opcode::SETDATW, static_cast<std::int16_t>(dest + done), addr + done};
+        instr.R = static_cast<std::uint8_t>(std::min(size - done, max_piece));
+        emit(instr);
+    }
 }
 
 void script_context::emit_return(const location& loc) {
     if (!cur_func.active_exprs.empty()) {
         auto type = cur_func.active_exprs.back().type;
-        if (type != std::get<type::function>(cur_func.type->t).ret_type) {
+        if (type != cur_func.signature.ret_type) {
             messages.emplace_back("Return type does not match", loc);
         }
+        auto unwind_loc = cur_func.expr_stack.size();
         auto result = eval_expr(0, loc);
         clear_expr();
         std::visit(overload {
@@ -339,11 +562,15 @@ void script_context::emit_return(const location& loc) {
             [](const addresses::data& a) { throw std::runtime_error("Not implemented."); },
             [](const addresses::global& a) { throw std::runtime_error("Not implemented."); }
         }, result.addr);
+        pop_objects_until(unwind_loc, true);
     }
     for (auto i = 0; i < cur_func.local_stack.size(); ++i) {
         auto& local = cur_func.local_stack[cur_func.local_stack.size() - i - 1].obj;
         emit_destroy(local);
     }
+    if (cur_func.memo) {
+        emit(cur_func.memo_store);
+    }
     emit(instruction{opcode::RET});
 }
 
@@ -357,7 +584,7 @@ void script_context::end_block(int unwind_to, bool cleanup, const location& loc)
             auto& local = cur_func.local_stack.back().obj;
             emit_destroy(local);
         }
-        cur_func.local_stack.pop_back();
+        pop_local();
     }
 }
 
@@ -365,18 +592,20 @@ void script_context::clear_expr() {
     cur_func.active_exprs.clear();
 }
 
-void script_context::emit_vardecl(const std::string& name, const location& loc) {
-    auto type = cur_func.active_exprs.back().type;
+void script_context::emit_vardecl(symbol_id name, const location& loc) {
+    auto unwind_loc = cur_func.expr_stack.size();
     auto result = eval_expr(0, loc);
     clear_expr();
     std::visit(overload {
         [&](const addresses::local& a) {
             auto dest = get_aligned_top(value_align(result.t), true);
-            if (a.value == dest) {
+            if (a.value == dest && cur_func.expr_stack.size() == unwind_loc + 1) {
                 promote_local(name, loc);
             } else {
+                // result lives above the locals, release the temporaries so the local takes the lowest free slot
+                pop_objects_until(unwind_loc, true);
                 auto local = add_local(name, result.t, loc);
-                emit_copy(local, result);
+                emit_move(local, result);
             }
         },
         [&](const addresses::data& a) {
@@ -389,7 +618,6 @@ void script_context::emit_vardecl(const std::string& name, const location& loc)
 }
 
 void script_context::emit_discard(const location& loc) {
-    auto type = cur_func.active_exprs.back().type;
     auto unwind_loc = cur_func.expr_stack.size();
     auto result = eval_expr(0, loc);
     clear_expr();
@@ -417,29 +645,202 @@ void script_context::emit_move(const object& dest, const object& src) {
     emit_copy(dest, src);
 }
 
-std::int16_t script_context::emit_if(const location& loc) {
+int script_context::emit_if(const location& loc) {
     auto bool_type = get_global_type("bool");
     auto type = cur_func.active_exprs.back().type;
     if (type != bool_type) {
         throw std::runtime_error("Not implemented: conversion to bool.");
     }
+    auto unwind_loc = cur_func.expr_stack.size();
     auto result = eval_expr(0, loc);
     clear_expr();
-    return std::visit(overload {
+    auto jmp = std::visit(overload {
         [&](const addresses::local& a) {
             return emit({opcode::JMPIFN, a.value, 0});
         },
-        [](const addresses::data& a) -> std::int16_t { throw std::runtime_error("Not implemented."); },
-        [](const addresses::global& a) -> std::int16_t { throw std::runtime_error("Not implemented."); }
+        [](const addresses::data& a) -> int { throw std::runtime_error("Not implemented."); },
+        [](const addresses::global& a) -> int { throw std::runtime_error("Not implemented."); }
     }, result.addr);
+    pop_objects_until(unwind_loc);
+    return jmp;
 }
 
-std::int16_t script_context::emit_jmp(const location& loc) {
+int script_context::emit_jmp(const location& loc) {
     return emit({opcode::JMP, 0, 0});
 }
 
-void script_context::set_jmp(std::int16_t addr, const location& loc) {
-    cur_func.text[addr].DI = static_cast<std::int16_t>(cur_func.text.size()) - addr - 1;
+void script_context::set_jmp(int addr, const location& loc) {
+    cur_func.text[addr].DI = static_cast<int>(cur_func.text.size()) - addr - 1;
+}
+
+void script_context::begin_case(const location& loc) {
+    auto type = cur_func.active_exprs.back().type;
+    if (type != get_global_type("int")) {
+        throw std::runtime_error("Not implemented: case on non-int.");
+    }
+    auto locals = static_cast<int>(cur_func.local_stack.size());
+    emit_vardecl(symbols.intern("?case"), loc);
+    auto scrutinee = cur_func.local_stack.back().obj.addr.value;
+    cur_func.cases.push_back({scrutinee, locals, emit_jmp(loc), {}, std::nullopt, {}});
+}
+
+void script_context::begin_case_arm(int value, const location& loc) {
+    auto& c = cur_func.cases.back();
+    using limits = std::numeric_limits<std::int16_t>;
+    if (value < limits::min() || value > limits::max()) {
+        messages.emplace_back("Case value out of range", loc);
+    }
+    for (const auto& arm : c.arms) {
+        if (arm.first == value) {
+            messages.emplace_back("Duplicate case value", loc);
+        }
+    }
+    c.arms.emplace_back(value, static_cast<int>(cur_func.text.size()));
+}
+
+void script_context::begin_case_default(const location& loc) {
+    auto& c = cur_func.cases.back();
+    if (c.default_arm) {
+        messages.emplace_back("Duplicate default case", loc);
+    }
+    c.default_arm = static_cast<int>(cur_func.text.size());
+}
+
+void script_context::end_case_arm(bool returned, const location& loc) {
+    if (!returned) {
+        cur_func.cases.back().exits.push_back(emit_jmp(loc));
+    }
+}
+
+void script_context::end_case(const location& loc) {
+    // smallest number of arms worth a table, and how sparse the table may be
+    constexpr int min_table_size = 4;
+    constexpr int max_table_spread = 2;
+
+    auto c = std::move(cur_func.cases.back());
+    cur_func.cases.pop_back();
+
+    // the arms come first, the dispatch code is emitted once all values are known
+    set_jmp(c.dispatch, loc);
+
+    auto arms = c.arms;
+    std::sort(begin(arms), end(arms));
+
+    const auto count = static_cast<int>(arms.size());
+    const auto range = count > 0 ? std::int64_t(arms.back().first) - arms.front().first + 1 : 0;
+    const auto first_table = cur_func.jump_tables.size();
+
+    if (count >= min_table_size && range <= max_table_spread * count && range <= std::numeric_limits<std::int16_t>::max()) {
+        auto table = jump_table{-1, arms.front().first, std::vector<int>(range, c.default_arm.value_or(-1))};
+        for (const auto& [value, target] : arms) {
+            table.targets[value - table.low] = target;
+        }
+        auto index = static_cast<std::int16_t>(cur_func.jump_tables.size());
+        table.jmptab = emit({opcode::JMPTAB, c.scrutinee, {index, static_cast<std::int16_t>(range)}});
+        cur_func.jump_tables.push_back(std::move(table));
+        emit_case_fallback(c, loc);
+    } else {
+        auto unwind_loc = cur_func.expr_stack.size();
+        auto flag = push_object(get_global_type("bool"), loc).addr.value;
+        emit_case_search(c, arms, 0, count, flag, loc);
+        pop_objects_until(unwind_loc);
+    }
+
+    auto end = static_cast<int>(cur_func.text.size());
+    for (auto jmp : c.exits) {
+        set_jmp(jmp, loc);
+    }
+    for (auto t = first_table; t < cur_func.jump_tables.size(); ++t) {
+        for (auto& target : cur_func.jump_tables[t].targets) {
+            if (target == -1) {
+                target = end;
+            }
+        }
+    }
+
+    end_block(c.locals, true, loc);
+}
+
+void script_context::emit_case_search(case_context& c, const std::vector<std::pair<int, int>>& arms, int lo, int hi, std::int16_t flag, const location& loc) {
+    if (hi - lo <= 3) {
+        for (int i = lo; i < hi; ++i) {
+            emit({opcode::ICNEC, flag, {c.scrutinee, static_cast<std::int16_t>(arms[i].first)}});
+            auto pc = static_cast<int>(cur_func.text.size());
+            emit({opcode::JMPIFN, flag, arms[i].second - pc - 1});
+        }
+        emit_case_fallback(c, loc);
+        return;
+    }
+
+    auto mid = (lo + hi) / 2;
+    emit({opcode::ICLTC, flag, {c.scrutinee, static_cast<std::int16_t>(arms[mid].first)}});
+    auto upper = emit({opcode::JMPIFN, flag, 0});
+    emit_case_search(c, arms, lo, mid, flag, loc);
+    set_jmp(upper, loc);
+    emit_case_search(c, arms, mid, hi, flag, loc);
+}
+
+void script_context::emit_case_fallback(case_context& c, const location& loc) {
+    if (c.default_arm) {
+        auto pc = static_cast<int>(cur_func.text.size());
+        emit({opcode::JMP, 0, *c.default_arm - pc - 1});
+    } else {
+        c.exits.push_back(emit_jmp(loc));
+    }
+}
+
+void script_context::begin_for(const location& loc) {
+    auto locals = static_cast<int>(cur_func.local_stack.size());
+    cur_func.loops.push_back({locals, -1, -1, -1});
+    emit_for_bound(loc);
+    cur_func.loops.back().counter = cur_func.local_stack.back().obj.addr.value;
+}
+
+void script_context::emit_for_bound(const location& loc) {
+    if (cur_func.active_exprs.back().type != get_global_type("int")) {
+        messages.emplace_back("For loop bounds must be int", loc);
+    }
+    // counter, limit and step end up in consecutive slots, FORPREP and FORLOOP address them as one operand
+    emit_vardecl(symbols.intern("?for"), loc);
+}
+
+void script_context::emit_for_step(const location& loc) {
+    // a step computed at run time may still be 0, FORPREP then runs the loop zero times
+    const auto& step = cur_func.active_exprs.back().expr;
+    if (auto c = std::get_if<expression::constant>(&step); c && std::holds_alternative<int>(c->val) && std::get<int>(c->val) == 0) {
+        messages.emplace_back("For loop step must not be 0", loc);
+    }
+    emit_for_bound(loc);
+}
+
+void script_context::emit_for_prep(symbol_id name, const location& loc) {
+    auto& l = cur_func.loops.back();
+    // the counter takes the loop variable's name, the limit above it now hides whatever the counter's ?for hid
+    auto& limit = cur_func.local_stack[l.locals + 1];
+    limit.shadowed = cur_func.local_stack[l.locals].shadowed;
+    bind_local(l.locals, name);
+    l.exit = emit({opcode::FORPREP, l.counter, 0});
+    l.head = static_cast<int>(cur_func.text.size());
+}
+
+void script_context::end_for(bool returned, const location& loc) {
+    auto l = cur_func.loops.back();
+    cur_func.loops.pop_back();
+    if (!returned) {
+        auto pc = static_cast<int>(cur_func.text.size());
+        emit({opcode::FORLOOP, l.counter, l.head - pc - 1});
+    }
+    set_jmp(l.exit, loc);
+    end_block(l.locals, true, loc);
+}
+
+auto script_context::add_jump_table(const jump_table& table, int jmptab) -> std::int32_t {
+    auto addr = append_jump_table(data, table, jmptab);
+    if (!addr) {
+        messages.emplace_back("Data section is too large", location{});
+        return 0;
+    }
+    return *addr;
 }
 
 auto script_context::push_func_args(int expr_loc, int nargs, const location& loc) -> int {
@@ -450,13 +851,16 @@ auto script_context::push_func_args(int expr_loc, int nargs, const location& loc
         const auto& expr = *(rbegin(cur_func.active_exprs) + expr_loc);
         auto type = expr.type;
         auto dest = get_aligned_top(value_align(type), false);
+        auto unwind_loc = cur_func.expr_stack.size();
         auto result = eval_expr(expr_loc, loc);
 
         std::visit(overload {
             [&](const addresses::local& a) {
                 if (a.value != dest) {
+                    // arguments must be contiguous, so drop whatever the argument left above its slot
+                    pop_objects_until(unwind_loc, true);
                     auto dest = push_object(type, loc);
-                    emit_copy(dest, result);
+                    emit_move(dest, result);
                 }
             },
             [&](const addresses::data&) {
@@ -478,18 +882,18 @@ object script_context::eval_expr(int expr_loc, const location& loc) {
     const auto& expr = *(rbegin(cur_func.active_exprs) + expr_loc);
 
     auto result = std::visit(overload {
-        [&](const expression::nothing&) -> object { return {addresses::local{0}, make_type_ptr(type::nothing{})}; },
+        [&](const expression::nothing&) -> object { return {addresses::local{0}, S->types.nothing()}; },
         [&](const expression::stack_id& id) -> object { return {addresses::local{id.addr}, expr.type}; },
         [&](const expression::function& id) -> object {
-            auto t = make_type_ptr(type::function_ptr{expr.type});
+            auto t = expr.type;
             auto func = push_object(t, loc);
             emit(instruction{opcode::SETADR, std::int16_t(func.addr.value), std::int16_t(id.addr)});
             return func;
         },
         [&](const expression::imported_function& id) -> object {
-            auto t = make_type_ptr(type::function_ptr{expr.type});
+            auto t = expr.type;
             auto func = push_object(t, loc);
-            emit(instruction{opcode::SETDAT, std::int16_t(func.addr.value), {std::int16_t(id.data_addr), value_size(t)}});
+            emit_data_load(std::int16_t(func.addr.value), id.data_addr, value_size(t));
             return func;
         },
         [&](const expression::constant& id) -> object {
@@ -540,7 +944,9 @@ object script_context::eval_expr(int expr_loc, const location& loc) {
                 }
             }
 
-            if (const_int) {
+            if (const_int && *const_int == 0 && id.def->nonzero_rhs) {
+                messages.emplace_back("Division by zero", loc);
+            } else if (const_int) {
                 id.def->emit_c_int(*this, dest.addr, lhs_result.addr, *const_int);
             } else {
                 auto rhs_result = eval_expr(expr_loc + 1, loc);
@@ -565,6 +971,8 @@ object script_context::eval_expr(int expr_loc, const location& loc) {
             auto ret_addr = get_aligned_top(alignof(std::max_align_t), false);
             cur_func.expr_stack.pop_back();
 
+            auto site_begin = static_cast<int>(cur_func.text.size());
+
             // calculate actual return value address
             auto result_addr = static_cast<std::int16_t>(ret_addr + get_return_value_offset(return_type));
             cur_func.expr_stack.push_back({addresses::local{result_addr}, return_type}); // return value
@@ -592,7 +1000,8 @@ object script_context::eval_expr(int expr_loc, const location& loc) {
                 },
             }, func_obj.addr);
 
-            emit({opcode::CALL, ret_addr, {target, 0}});
+            auto call_idx = emit({opcode::CALL, ret_addr, {target, 0}});
+            cur_func.call_sites.push_back({site_begin, call_idx, result_addr});
 
             pop_objects_until(unwind_loc, true);
 
@@ -601,7 +1010,7 @@ object script_context::eval_expr(int expr_loc, const location& loc) {
         [&](const expression::dataload& dl) -> object {
             auto type = expr.type;
             auto val = push_object(type, loc);
-            emit({opcode::SETDAT, val.addr.value, {dl.addr, value_size(*type)}});
+            emit_data_load(val.addr.value, dl.addr, value_size(*type));
             return val;
         },
     }, expr.expr);
@@ -1,14 +1,19 @@
 #pragma once
 
+#include "arena.hpp"
 #include "asm_context.hpp"
 #include "types.hpp"
 #include "compile_message.hpp"
+#include "control_flow.hpp"
 #include "location.hpp"
 #include "utility.hpp"
 #include "state.hpp"
+#include "symbol_table.hpp"
 
 #include <cassert>
 #include <charconv>
+#include <memory_resource>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -53,7 +58,7 @@ struct expression {
     };
 
     struct imported_function {
-        std::int16_t data_addr;
+        std::int32_t data_addr;
     };
 
     struct constant {
@@ -61,7 +66,7 @@ struct expression {
     };
 
     struct binary {
-        std::shared_ptr<const binop_def> def;
+        const binop_def* def;
     };
 
     struct call {
@@ -69,70 +74,152 @@ struct expression {
     };
 
     struct dataload {
-        std::int16_t addr;
+        std::int32_t addr;
     };
 
     std::variant<nothing, stack_id, function, imported_function, constant, binary, call, dataload> expr;
     type_ptr type;
     category category;
+    int size = 1; // entries in this expression's subtree, itself included; operands come right before it
 };
 
 struct variable {
-    std::string name;
+    symbol_id name;
     stack_object obj;
+    int shadowed = -1; // local stack index of the binding of the same name this one hides
 
     variable() = default;
-    variable(std::string name, stack_object obj) : name(std::move(name)), obj(std::move(obj)) {}
+    variable(symbol_id name, stack_object obj) : name(name), obj(std::move(obj)) {}
 };
 
-struct function_context {
+struct call_site {
+    int begin; // text index where the callee frame starts being filled
+    int call; // text index of the CALL
+    std::int16_t ret; // stack addr of the return value, directly below the callee frame
+};
+
+struct function_extent {
     std::string name;
+    int begin; // text address of the entry
+    int end;
+};
+
+struct case_context {
+    std::int16_t scrutinee; // stack addr of the value being matched
+    int locals; // local stack size before the scrutinee
+    int dispatch; // text index of the JMP to the dispatch code
+    std::vector<std::pair<int, int>> arms; // value, text index of the arm
+    std::optional<int> default_arm;
+    std::vector<int> exits; // text indices of the JMPs to the end
+};
+
+struct loop_context {
+    int locals; // local stack size before the loop
+    int head; // text index the loop jumps back to
+    int exit; // text index of the jump out of the loop
+    std::int16_t counter; // stack addr of the counter, limit and step of a numeric for
+};
+
+struct function_context {
+    symbol_id name;
+    int index = 0; // position in the module; SETADR refers to functions by index until link_functions
+    std::int16_t frame_top = 0; // top of the locals when the body ends
     std::vector<instruction> text;
-    std::vector<expression> active_exprs;
-    std::vector<variable> local_stack;
-    std::vector<stack_object> expr_stack;
-    type_ptr type;
+    std::pmr::vector<expression> active_exprs;
+    std::pmr::vector<variable> local_stack;
+    std::pmr::unordered_map<symbol_id, int> bindings; // innermost local stack index of each name
+    std::pmr::vector<stack_object> expr_stack;
+    std::vector<call_site> call_sites;
+    std::vector<jump_table> jump_tables;
+    std::vector<case_context> cases;
+    std::vector<loop_context> loops;
+    bool memo = false;
+    bool exported = false;
+    instruction memo_store; // MEMOSET to run before every return
+    type::function signature; // built up by add_param and set_return_type
+    type_ptr type; // interned from the signature once the return type is known
 
     function_context() = default;
-    function_context(std::string name) : name(std::move(name)) {}
+    function_context(symbol_id name, std::pmr::memory_resource* mem) :
+        name(name), active_exprs(mem), local_stack(mem), bindings(mem), expr_stack(mem) {}
+};
+
+// Function bodies of a lazily compiled module, each waiting behind a LAZY stub for its first call.
+struct pending_functions {
+    std::vector<function_context> bodies; // by function index, emptied once compiled
+    std::vector<std::int32_t> stubs; // text address of each function's stub
+    std::vector<std::int32_t> entries; // text address each function is called at, its stub until it is compiled
+    std::vector<std::vector<int>> callers; // text addresses of compiled SETADRs that still load a function's stub
 };
 
+// Optimizes the body of function `index` of `m`, appends it to the text and turns its stub into a jump to the body.
+// SETADRs that load the stub are patched to load the body instead. Returns false, leaving the module as it was, if it
+// has no room left.
+bool compile_pending(module& m, int index);
+
 struct script_context {
-    static constexpr int stack_max = 16384;
+    static constexpr int stack_max = 0x7fff; // as far as a stack operand reaches
     state* S;
+    monotonic_arena arena; // per-translation-unit data, released when the context is destroyed
+    symbol_table symbols{arena};
     std::vector<instruction> program;
     std::vector<std::byte> data;
     std::vector<compile_message> messages;
-    function_context cur_func;
-    std::unordered_map<std::string, object> static_scope;
+    function_context cur_func{{}, &arena};
+    std::pmr::unordered_map<symbol_id, object> static_scope{&arena};
     int main_entry = -1;
-    std::unordered_map<std::string, type_ptr> global_types;
-    type_ptr nulltype;
+    int memo_count = 0;
+    unsigned compile_threads = 0; // threads for optimizing function bodies, 0 means one per core
+    std::vector<function_extent> functions;
+    std::vector<function_context> bodies; // generated functions waiting for link_functions
+    std::shared_ptr<pending_functions> pending; // left by link_functions when compiling lazily
+    std::vector<symbol> exports;
+    std::vector<moonflower::import> imports;
+    std::vector<relocation> relocations; // one per imported function, so a module file can be linked anywhere
     std::optional<std::uint16_t> current_import_module;
 
     script_context(state& S);
 
-    type::usertype& new_usertype(const std::string& name);
-
     type_ptr get_global_type(const std::string& name);
 
-    void begin_import(const std::string& module_name);
+    type_ptr get_global_type(symbol_id name);
+
+    void begin_import(symbol_id module_name);
 
-    void import(const std::string& func_name);
+    void import(symbol_id func_name);
 
-    void begin_func(const std::string& name, const location& loc);
+    void begin_func(symbol_id name, const location& loc);
 
     void end_func();
 
-    void add_param(const std::string& name, const type_ptr& type, const location& loc);
+    // Exports the function that was just defined.
+    void export_func();
+
+    // Optimizes the generated function bodies in parallel, then appends them to the program in definition order and
+    // resolves function addresses. When the state compiles lazily, appends a stub per function instead, see
+    // pending_functions.
+    void link_functions();
+
+    void stub_functions();
+
+    void add_param(symbol_id name, const type_ptr& type, const location& loc);
 
     void set_return_type(const type_ptr& type, const location& loc);
 
+    void set_memo();
+
+    void emit_memo_lookup(const location& loc);
+
     auto get_aligned_top(std::int16_t align, bool exclude_expr) -> std::int16_t;
 
-    auto add_local(const std::string& name, const type_ptr& t, const location& loc) -> const stack_object&;
+    auto add_local(symbol_id name, const type_ptr& t, const location& loc) -> const stack_object&;
+
+    void promote_local(symbol_id name, const location& loc);
+
+    // Makes the local at `index` visible under `name`, hiding any outer binding until it is popped.
+    void bind_local(int index, symbol_id name);
 
-    void promote_local(const std::string& name, const location& loc);
+    void pop_local();
 
     auto push_object(const type_ptr& t, const location& loc) -> const stack_object&;
 
@@ -146,11 +233,11 @@ struct script_context {
 
     stack_object get_return_object();
 
-    std::optional<stack_object> stack_lookup(const std::string& name);
+    std::optional<stack_object> stack_lookup(symbol_id name);
 
-    std::optional<object> static_lookup(const std::string& name);
+    std::optional<object> static_lookup(symbol_id name);
 
-    int expr_id(const std::string& name, const location& loc);
+    int expr_id(symbol_id name, const location& loc);
 
     int expr_const_int(int val);
 
@@ -162,7 +249,10 @@ struct script_context {
 
     int expr_call(int nargs, const location& loc);
 
-    std::int16_t emit(const instruction& instr);
+    int emit(const instruction& instr);
+
+    // Loads `size` bytes of data at `addr` to `dest`, with SETDAT when the address fits it and SETDATW otherwise.
+    void emit_data_load(std::int16_t dest, std::int32_t addr, std::int16_t size);
 
     void emit_return(const location& loc);
 
@@ -172,7 +262,7 @@ struct script_context {
 
     void clear_expr();
 
-    void emit_vardecl(const std::string& name, const location& loc);
+    void emit_vardecl(symbol_id name, const location& loc);
 
     void emit_discard(const location& loc);
 
@@ -180,11 +270,37 @@ struct script_context {
 
     void emit_move(const object& dest, const object& src);
 
-    std::int16_t emit_if(const location& loc);
+    int emit_if(const location& loc);
+
+    int emit_jmp(const location& loc);
+
+    void set_jmp(int addr, const location& loc);
+
+    void begin_case(const location& loc);
+
+    void begin_case_arm(int value, const location& loc);
+
+    void begin_case_default(const location& loc);
+
+    void end_case_arm(bool returned, const location& loc);
+
+    void end_case(const location& loc);
+
+    void emit_case_search(case_context& c, const std::vector<std::pair<int, int>>& arms, int lo, int hi, std::int16_t flag, const location& loc);
+
+    void emit_case_fallback(case_context& c, const location& loc);
+
+    void begin_for(const location& loc);
+
+    void emit_for_bound(const location& loc);
+
+    void emit_for_step(const location& loc);
+
+    void emit_for_prep(symbol_id name, const location& loc);
 
-    std::int16_t emit_jmp(const location& loc);
+    void end_for(bool returned, const location& loc);
 
-    void set_jmp(std::int16_t addr, const location& loc);
+    auto add_jump_table(const jump_table& table, int jmptab) -> std::int32_t;
 
     auto push_func_args(int expr_loc, int nargs, const location& loc) -> int;
 
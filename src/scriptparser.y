@@ -38,17 +38,24 @@
 %define api.token.prefix {TK_}
 
 %token IMPORT EXPORT AS
-%token FUNC RETURN
+%token FUNC RETURN MEMO
 %token VAR
 %token IF ARROW
+%token CASE
+%token FOR IN
+%token SHL SHR
 
-%token <std::string> IDENTIFIER
+%token <moonflower::symbol_id> IDENTIFIER
 %token <int> INTEGER
 %token <bool> BOOLEAN
 
 %left '<'
+%left '|'
+%left '^'
+%left '&'
+%left SHL SHR
 %left '+' '-'
-%left '*' '/'
+%left '*' '/' '%'
 
 %token EOF 0
 
@@ -56,7 +63,7 @@
 %type <int> arguments argumentseq
 %type <int> blockstatseq
 %type <bool> block
-%type <std::int16_t> ifcase
+%type <int> ifcase
 %type <moonflower::type_ptr> type
 
 %start chunk
@@ -88,9 +95,12 @@ topstatseq: topstatement
           ;
 
 topstatement: funcdecl
+            | EXPORT funcdecl { context.export_func(); }
             ;
 
-funcdecl: FUNC IDENTIFIER[id] { context.begin_func($id, @$); } funcbody { context.end_func(); };
+funcdecl: FUNC IDENTIFIER[id] { context.begin_func($id, @$); } funcbody { context.end_func(); }
+        | MEMO FUNC IDENTIFIER[id] { context.begin_func($id, @$); context.set_memo(); } funcbody { context.end_func(); }
+        ;
 
 funcbody: '(' funcparams ')' ':' type { context.set_return_type($type, @$); } block { if (!$block) context.emit_return(@$); }
         ;
@@ -128,10 +138,12 @@ type: IDENTIFIER { $$ = context.get_global_type($IDENTIFIER); }
 statement: vardecl
          | functioncall { context.emit_discard(@$); }
          | ifstatement
+         | casestatement
+         | forstatement
          ;
 
 ifstatement: IF '{' ifcaseseq '}'
-           | IF expr <std::int16_t>{ $$ = context.emit_if(@$); } block { context.set_jmp($3, @$); }
+           | IF expr <int>{ $$ = context.emit_if(@$); } block { context.set_jmp($3, @$); }
            ;
 
 ifcaseseq: ifcase { context.set_jmp($1, @$); }
@@ -139,9 +151,27 @@ ifcaseseq: ifcase { context.set_jmp($1, @$); }
          | ifcasedefault
          ;
 
-ifcase: expr <std::int16_t>{ $$ = context.emit_if(@$); } block { $$ = context.emit_jmp(@$); context.set_jmp($2, @$); }
+ifcase: expr <int>{ $$ = context.emit_if(@$); } block { $$ = context.emit_jmp(@$); context.set_jmp($2, @$); }
       ;
 
+casestatement: CASE expr { context.begin_case(@$); } '{' casearmseq '}' { context.end_case(@$); }
+             ;
+
+casearmseq: casearm
+          | casearmseq casearm
+          ;
+
+casearm: INTEGER[value] { context.begin_case_arm($value, @$); } block { context.end_case_arm($block, @$); }
+       | '_' { context.begin_case_default(@$); } block { context.end_case_arm($block, @$); }
+       ;
+
+forstatement: FOR IDENTIFIER[id] IN expr { context.begin_for(@$); } ',' expr { context.emit_for_bound(@$); } forstep { context.emit_for_prep($id, @$); } block { context.end_for($block, @$); }
+            ;
+
+forstep: %empty { context.expr_const_int(1); context.emit_for_bound(@$); }
+       | ',' expr { context.emit_for_step(@$); }
+       ;
+
 ifcasedefault: '_' block
              ;
 
@@ -165,6 +195,12 @@ binaryop: expr[lhs] '+' expr[rhs] { $$ = context.expr_binop(binop::ADD, $lhs, $r
         | expr[lhs] '-' expr[rhs] { $$ = context.expr_binop(binop::SUB, $lhs, $rhs, @$); }
         | expr[lhs] '*' expr[rhs] { $$ = context.expr_binop(binop::MUL, $lhs, $rhs, @$); }
         | expr[lhs] '/' expr[rhs] { $$ = context.expr_binop(binop::DIV, $lhs, $rhs, @$); }
+        | expr[lhs] '%' expr[rhs] { $$ = context.expr_binop(binop::MOD, $lhs, $rhs, @$); }
+        | expr[lhs] SHL expr[rhs] { $$ = context.expr_binop(binop::SHL, $lhs, $rhs, @$); }
+        | expr[lhs] SHR expr[rhs] { $$ = context.expr_binop(binop::SHR, $lhs, $rhs, @$); }
+        | expr[lhs] '&' expr[rhs] { $$ = context.expr_binop(binop::AND, $lhs, $rhs, @$); }
+        | expr[lhs] '|' expr[rhs] { $$ = context.expr_binop(binop::OR, $lhs, $rhs, @$); }
+        | expr[lhs] '^' expr[rhs] { $$ = context.expr_binop(binop::XOR, $lhs, $rhs, @$); }
         | expr[lhs] '<' expr[rhs] { $$ = context.expr_binop(binop::CLT, $lhs, $rhs, @$); }
         ;
 
@@ -206,9 +242,9 @@ retstat ::= "return" [ expr { "," expr } ]
 assignment ::= lvalue { "," lvalue } = expr { "," expr }
 functioncall ::= prefixexpr "(" [ expr { "," expr } ] ")"
 whilestat ::= "while" expr "{" block "}"
-forstat ::= "for" vardeclname "in" expr "{" block "}"
+forstat ::= "for" vardeclname "in" expr "{" block "}" | "for" IDENT "in" expr "," expr [ "," expr ] "{" block "}"
 vardecl ::= "var" IDENT { "," IDENT } "=" expr { "," expr }
-funcdecl ::= "func" IDENT funcbody
+funcdecl ::= [ "memo" ] "func" IDENT funcbody
 expr ::=
     prefixexpr |
     funcdef |
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace moonflower {
+
+// Contiguous elements that are either owned or borrowed from memory kept alive by `backing`, like a module file mapped
+// by the loader. Borrowed elements can be written in place; anything that changes the size copies them into owned
+// storage first, and so does copying the segment.
+template <typename T>
+class segment {
+public:
+    segment() = default;
+
+    segment(std::vector<T> v) : owned(std::move(v)) {
+        reset();
+    }
+
+    segment(T* p, std::size_t n, std::shared_ptr<void> backing) : ptr(p), count(n), backing(std::move(backing)) {}
+
+    segment(const segment& o) : owned(o.begin(), o.end()) {
+        reset();
+    }
+
+    segment(segment&& o) noexcept : owned(std::move(o.owned)), ptr(o.ptr), count(o.count), backing(std::move(o.backing)) {
+        if (!backing) {
+            reset();
+        }
+        o.owned.clear();
+        o.reset();
+    }
+
+    segment& operator=(segment o) noexcept {
+        owned = std::move(o.owned);
+        ptr = o.ptr;
+        count = o.count;
+        backing = std::move(o.backing);
+        if (!backing) {
+            reset();
+        }
+        o.owned.clear();
+        o.reset();
+        return *this;
+    }
+
+    bool borrowed() const { return backing != nullptr; }
+
+    T* data() { return ptr; }
+    const T* data() const { return ptr; }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T* begin() { return ptr; }
+    T* end() { return ptr + count; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+
+    T& operator[](std::size_t i) { return ptr[i]; }
+    const T& operator[](std::size_t i) const { return ptr[i]; }
+
+    void push_back(const T& v) {
+        own();
+        owned.push_back(v);
+        reset();
+    }
+
+    template <typename It>
+    void insert(const T* pos, It first, It last) {
+        auto at = pos - ptr;
+        own();
+        owned.insert(owned.begin() + at, first, last);
+        reset();
+    }
+
+    void resize(std::size_t n) {
+        own();
+        owned.resize(n);
+        reset();
+    }
+
+private:
+    void own() {
+        if (backing) {
+            owned.assign(ptr, ptr + count);
+            backing.reset();
+        }
+    }
+
+    void reset() {
+        ptr = owned.data();
+        count = owned.size();
+    }
+
+    std::vector<T> owned;
+    T* ptr = nullptr;
+    std::size_t count = 0;
+    std::shared_ptr<void> backing;
+};
+
+}
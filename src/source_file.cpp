@@ -0,0 +1,48 @@
+#include "source_file.hpp"
+
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace moonflower {
+
+source_file::source_file(const std::string& path) {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            auto p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<const char*>(p);
+                size = st.st_size;
+                mapped = true;
+                ok = true;
+            }
+        }
+        ::close(fd);
+    }
+
+    if (!mapped) {
+        auto file = std::ifstream(path, std::ios::binary);
+        if (file) {
+            auto ss = std::stringstream{};
+            ss << file.rdbuf();
+            contents = ss.str();
+            data = contents.data();
+            size = contents.size();
+            ok = true;
+        }
+    }
+}
+
+source_file::~source_file() {
+    if (mapped) {
+        ::munmap(const_cast<char*>(data), size);
+    }
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace moonflower {
+
+// The whole contents of a source file, memory-mapped so the lexer reads straight from the file's pages.
+// Falls back to reading the file into memory when it cannot be mapped.
+class source_file {
+public:
+    explicit source_file(const std::string& path);
+    ~source_file();
+
+    source_file(const source_file&) = delete;
+    source_file& operator=(const source_file&) = delete;
+
+    explicit operator bool() const { return ok; }
+
+    auto text() const -> std::string_view { return {data, size}; }
+
+private:
+    const char* data = nullptr;
+    std::size_t size = 0;
+    bool mapped = false;
+    bool ok = false;
+    std::string contents; // used when the file is not mapped
+};
+
+}
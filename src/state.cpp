@@ -1,33 +1,532 @@
 #include "state.hpp"
 
+#include "compact_text.hpp"
 #include "compile.hpp"
 #include "interp.hpp"
+#include "loader.hpp"
+#include "verifier.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <utility>
 
 namespace moonflower {
 
+namespace {
+
+// Calls to imported functions copy the callee's program_addr out of the data segment. Once the imports are resolved
+// the linker turns those copies into immediate loads, so a cross-module call costs the same as a local one.
+void link_import_calls(module& m) {
+    if (m.relocations.empty()) {
+        return;
+    }
+
+    auto targets = std::unordered_map<std::int32_t, program_addr>{}; // data offset of each imported program_addr
+    for (const auto& r : m.relocations) {
+        auto adr = program_addr{};
+        std::memcpy(&adr, m.data.data() + r.offset, sizeof(adr));
+        targets.emplace(r.offset, adr);
+    }
+
+    for (auto& instr : m.text) {
+        auto iter = targets.end();
+        if (instr.OP == SETDAT && instr.BC.C == sizeof(program_addr)) {
+            iter = targets.find(instr.BC.B);
+        } else if (instr.OP == SETDATW && instr.R == sizeof(program_addr)) {
+            iter = targets.find(instr.DI);
+        }
+        // SETXADR only reaches the first 64k instructions, calls past them keep loading the address
+        if (iter != targets.end() && iter->second.off <= std::numeric_limits<std::uint16_t>::max()) {
+            const auto& adr = iter->second;
+            instr = instruction{SETXADR, instr.A, {std::int16_t(adr.mod), std::int16_t(adr.off)}};
+        }
+    }
+}
+
+// Calls to host functions name one of the module's natives until they are linked to the ids the state gave those
+// natives. `linked` holds the ids the calls were linked to before, if they were, as in a restored state image.
+void link_native_calls(module& m, const std::vector<std::uint32_t>& linked) {
+    if (m.natives.empty() || linked == m.native_ids) {
+        return;
+    }
+
+    auto ids = std::unordered_map<std::int32_t, std::int32_t>{};
+    for (std::size_t i = 0; i < m.natives.size(); ++i) {
+        ids.emplace(linked.empty() ? std::int32_t(i) : std::int32_t(linked[i]), std::int32_t(m.native_ids[i]));
+    }
+
+    for (auto& instr : m.text) {
+        if (instr.OP == CFLOAD || instr.OP == CFCALL) {
+            if (auto iter = ids.find(instr.DI); iter != ids.end()) {
+                instr.DI = iter->second;
+            }
+        }
+    }
+}
+
+// Hashes each function's body with every address replaced by what it refers to, so a function hashes the same in
+// any version of its module that leaves it alone.
+void hash_functions(module& m) {
+    auto names = std::unordered_map<std::uint32_t, const std::string*>{};
+    for (const auto& f : m.functions) {
+        names.emplace(f.entry, &f.name);
+        names.emplace(f.begin, &f.name);
+    }
+
+    for (auto& f : m.functions) {
+        auto h = hasher{};
+        for (auto pc = f.begin; pc < f.end; ++pc) {
+            const auto& instr = m.text[pc];
+            h.add_value(instr.OP);
+            h.add_value(instr.R);
+            h.add_value(instr.A);
+            switch (instr.OP) {
+                case SETADR:
+                    if (auto iter = names.find(std::uint32_t(instr.DI)); iter != names.end()) {
+                        h.add(*iter->second);
+                    }
+                    break;
+                case SETDAT:
+                    h.add(m.data.data() + instr.BC.B, instr.BC.C);
+                    break;
+                case SETDATW:
+                    h.add(m.data.data() + instr.DI, instr.R);
+                    break;
+                case JMPTAB:
+                case JMPTABW: {
+                    // the table and the size stored before it
+                    auto table = instr.OP == JMPTAB ? instr.BC.B : instr.DI;
+                    auto size = std::int32_t{};
+                    std::memcpy(&size, m.data.data() + table - sizeof(size), sizeof(size));
+                    h.add(m.data.data() + table - sizeof(size), (2 + size) * sizeof(std::int32_t));
+                    break;
+                }
+                case MEMOGET:
+                case MEMOSET:
+                    h.add_value(instr.BC.B);
+                    break;
+                default:
+                    h.add_value(instr.DI);
+                    break;
+            }
+        }
+        // a lazy function has nothing to compare until it is compiled
+        f.hash = m.text[f.begin].OP == LAZY ? 0 : h.get();
+    }
+}
+
+}
+
 std::int16_t state::load(module m) {
+    auto messages = std::vector<compile_message>{};
+    if (!link_natives(m, messages)) {
+        return -1;
+    }
+    link_native_calls(m, {});
+    link_import_calls(m);
+    hash_functions(m);
+
+    m.return_area = return_area(m);
+    if (m.pending) {
+        for (const auto& body : m.pending->bodies) {
+            m.return_area = std::max(m.return_area, return_area(body.text.data(), body.text.data() + body.text.size()));
+        }
+    }
+    return add_module(std::move(m));
+}
+
+std::int16_t state::add_module(module m) {
+    auto mod_idx = static_cast<std::int16_t>(modules.size());
+
+    max_return_area = std::max(max_return_area, m.return_area);
+
+    auto& exports = export_index.emplace_back();
+    exports.reserve(m.exports.size());
+    for (std::uint32_t i = 0; i < m.exports.size(); ++i) {
+        exports.emplace(m.exports[i].name, i);
+    }
+    module_index.emplace(m.name, mod_idx);
+
+    auto& functions = function_index.emplace_back();
+    functions.reserve(m.functions.size());
+    for (std::uint32_t i = 0; i < m.functions.size(); ++i) {
+        functions.emplace(m.functions[i].name, i);
+    }
+
     modules.push_back(std::move(m));
-    return modules.size() - 1;
+    return mod_idx;
 }
 
 load_result state::load(const std::string& name, std::istream& source_code) {
-    auto tu = compile(*this, name, source_code);
+    auto ss = std::stringstream{};
+    ss << source_code.rdbuf();
+    auto source = ss.str();
+    return load(name, std::string_view(source));
+}
+
+load_result state::load(const std::string& name, std::string_view source_code) {
+    auto tu = compile_module(name, source_code, compile_threads);
 
     if (tu.r == result::SUCCESS) {
-        modules.push_back(std::move(tu.m));
+        auto mod_idx = load(std::move(tu.m));
+
+        return {mod_idx, std::move(tu.messages), tu.arena_stats};
+    } else {
+        return {std::nullopt, std::move(tu.messages), tu.arena_stats};
+    }
+}
+
+load_result state::load_compiled(const std::string& path) {
+    auto messages = std::vector<compile_message>{};
+    auto error = std::string{};
+    auto m = read_module(path, error);
+
+    if (!m) {
+        messages.emplace_back(std::move(error), location{});
+    }
+
+    if (m && link_imports(*m, messages) && link_natives(*m, messages) && verify(*m, messages)) {
+        auto mod_idx = load(std::move(*m));
+
+        return {mod_idx, std::move(messages), {}};
+    } else {
+        return {std::nullopt, std::move(messages), {}};
+    }
+}
+
+bool state::save_image(std::ostream& out, std::string& error) {
+    // an image holds no stubs, its functions are ready to run
+    for (std::size_t mod_idx = 0; mod_idx < modules.size(); ++mod_idx) {
+        if (auto pending = modules[mod_idx].pending) {
+            for (std::size_t i = 0; i < pending->stubs.size(); ++i) {
+                if (pending->entries[i] == pending->stubs[i] && !resolve(std::int16_t(mod_idx), std::int32_t(i))) {
+                    error = "Module " + modules[mod_idx].name + " is too large to compile all of its functions";
+                    return false;
+                }
+            }
+        }
+    }
+    return write_image(out, modules, error);
+}
+
+bool state::restore_image(const std::string& path, std::string& error) {
+    auto restored = read_image(path, error);
+    if (!restored) {
+        return false;
+    }
 
-        return {modules.size() - 1, std::move(tu.messages)};
+    // host functions keep their names across processes but not their ids, calls are only relinked where they differ
+    auto messages = std::vector<compile_message>{};
+    for (auto& m : *restored) {
+        auto linked = std::exchange(m.native_ids, {});
+        if (!link_natives(m, messages)) {
+            error = "State image " + path + ": " + messages.front().message;
+            return false;
+        }
+        link_native_calls(m, linked);
+    }
+
+    modules.clear();
+    module_index.clear();
+    export_index.clear();
+    function_index.clear();
+    memo.clear();
+    max_return_area = 0;
+
+    // linked and sized when the image was written
+    for (auto& m : *restored) {
+        add_module(std::move(m));
+    }
+    return true;
+}
+
+load_result state::reload(std::int16_t mod_idx, std::string_view source_code) {
+    // the swapped functions are compiled up front, the pause should not include a stub's first call
+    auto was_lazy = std::exchange(lazy, false);
+    auto tu = compile_module(modules[mod_idx].name, source_code, compile_threads);
+    lazy = was_lazy;
+
+    if (tu.r == result::SUCCESS && reload(mod_idx, std::move(tu.m), tu.messages)) {
+        return {mod_idx, std::move(tu.messages), tu.arena_stats};
     } else {
-        return {std::nullopt, std::move(tu.messages)};
+        return {std::nullopt, std::move(tu.messages), tu.arena_stats};
     }
 }
 
-interp_result state::execute(std::int16_t mod_idx, std::int16_t func_addr, int ret_size) {
+bool state::reload(std::int16_t mod_idx, module updated, std::vector<compile_message>& messages) {
+    auto& m = modules[mod_idx];
+
+    auto fail = [&](const std::string& why) {
+        messages.emplace_back("Cannot reload " + m.name + ": " + why, location{});
+        return false;
+    };
+
+    if (running > 0) {
+        return fail("a script is running");
+    }
+    if (m.functions.empty() && m.text.size() > 1) {
+        return fail("it was not compiled from source");
+    }
+    if (updated.pending) {
+        return fail("the new version was compiled lazily");
+    }
+
+    link_import_calls(updated);
+    hash_functions(updated);
+
+    auto& functions = function_index[mod_idx];
+
+    struct swap {
+        const function_info* updated;
+        std::optional<std::uint32_t> old; // position in m.functions
+        std::uint32_t body;
+    };
+
+    // changed and new functions go after the current text, everything else stays where it is
+    auto swaps = std::vector<swap>{};
+    auto addr_of = std::unordered_map<std::uint32_t, std::uint32_t>{}; // updated function address to its address in m
+    auto text_size = m.text.size();
+    for (const auto& f : updated.functions) {
+        auto iter = functions.find(f.name);
+        if (iter != functions.end() && f.hash != 0 && m.functions[iter->second].hash == f.hash) {
+            addr_of.emplace(f.begin, m.functions[iter->second].begin);
+            continue;
+        }
+        auto old = iter != functions.end() ? std::optional<std::uint32_t>(iter->second) : std::nullopt;
+        swaps.push_back({&f, old, static_cast<std::uint32_t>(text_size)});
+        addr_of.emplace(f.begin, static_cast<std::uint32_t>(text_size));
+        text_size += f.end - f.begin;
+    }
+
+    const auto data_base = static_cast<int>(m.data.size());
+    if (text_size > std::size_t(std::numeric_limits<std::int32_t>::max())) {
+        return fail("the text would be too large");
+    }
+    if (!swaps.empty() && data_base + updated.data.size() > std::size_t(std::numeric_limits<std::int32_t>::max())) {
+        return fail("the data segment would be too large");
+    }
+    if (m.memo_ids + updated.memo_ids > std::numeric_limits<std::int16_t>::max()) {
+        return fail("too many memo functions");
+    }
+
+    // bodies are copied out first, nothing changes unless every address can be moved
+    auto text = std::vector<instruction>{};
+    text.reserve(text_size - m.text.size());
+    for (const auto& s : swaps) {
+        for (auto pc = s.updated->begin; pc < s.updated->end; ++pc) {
+            auto instr = updated.text[pc];
+            switch (instr.OP) {
+                case SETADR: {
+                    auto iter = addr_of.find(std::uint32_t(instr.DI));
+                    if (iter == addr_of.end()) {
+                        return fail("function " + s.updated->name + " loads an address that is not a function");
+                    }
+                    instr.DI = iter->second;
+                    break;
+                }
+                case SETDAT:
+                    // data moved past the reach of B is loaded with the wide form
+                    if (auto addr = instr.BC.B + data_base; addr <= std::numeric_limits<std::int16_t>::max()) {
+                        instr.BC.B = static_cast<std::int16_t>(addr);
+                    } else if (instr.BC.C <= std::numeric_limits<std::uint8_t>::max()) {
+                        auto size = static_cast<std::uint8_t>(instr.BC.C);
+                        instr = instruction{SETDATW, instr.A, addr};
+                        instr.R = size;
+                    } else {
+                        return fail("function " + s.updated->name + " loads too much data at once");
+                    }
+                    break;
+                case JMPTAB:
+                    if (auto addr = instr.BC.B + data_base; addr <= std::numeric_limits<std::int16_t>::max()) {
+                        instr.BC.B = static_cast<std::int16_t>(addr);
+                    } else {
+                        instr = instruction{JMPTABW, instr.A, addr};
+                    }
+                    break;
+                case SETDATW:
+                case JMPTABW:
+                    instr.DI += data_base;
+                    break;
+                case MEMOGET:
+                case MEMOSET:
+                    instr.BC.C += m.memo_ids;
+                    break;
+                default:
+                    break;
+            }
+            text.push_back(instr);
+        }
+    }
+
+    if (swaps.empty()) {
+        return true;
+    }
+
+    m.text.insert(m.text.end(), text.begin(), text.end());
+    m.data.insert(m.data.end(), updated.data.begin(), updated.data.end());
+    update_compact(m, m.text.size() - text.size(), m.text.size());
+
+    auto jump = [&](std::uint32_t from, std::uint32_t to) {
+        m.text[from] = instruction{opcode::JMP, 0, std::int32_t(to) - std::int32_t(from) - 1};
+        update_compact(m, from, from + 1);
+    };
+
+    for (const auto& s : swaps) {
+        auto end = static_cast<std::uint32_t>(s.body + (s.updated->end - s.updated->begin));
+        if (!s.old) {
+            functions.emplace(s.updated->name, static_cast<std::uint32_t>(m.functions.size()));
+            m.functions.push_back({s.updated->name, s.body, s.body, end, s.updated->hash});
+            continue;
+        }
+
+        // callers were given the entry, and may hold the current body or a lazily compiled one
+        auto& f = m.functions[*s.old];
+        jump(f.entry, s.body);
+        if (f.begin != f.entry) {
+            jump(f.begin, s.body);
+        }
+        if (m.pending && *s.old < m.pending->entries.size()) {
+            auto& compiled = m.pending->entries[*s.old];
+            if (auto at = static_cast<std::uint32_t>(compiled); at != f.entry && at != f.begin) {
+                jump(at, s.body);
+            }
+            compiled = s.body;
+        }
+        f.begin = s.body;
+        f.end = end;
+        f.hash = s.updated->hash;
+    }
+
+    for (const auto& e : updated.exports) {
+        if (!find_export(mod_idx, e.name)) {
+            export_index[mod_idx].emplace(e.name, static_cast<std::uint32_t>(m.exports.size()));
+            m.exports.push_back({e.name, addr_of[e.addr]});
+        }
+    }
+    if (m.entry_point == no_entry_point && updated.entry_point != no_entry_point) {
+        m.entry_point = addr_of[updated.entry_point];
+    }
+
+    const auto import_base = static_cast<std::uint16_t>(m.imports.size());
+    m.imports.insert(m.imports.end(), updated.imports.begin(), updated.imports.end());
+    for (auto r : updated.relocations) {
+        r.offset += data_base;
+        r.import += import_base;
+        m.relocations.push_back(r);
+    }
+
+    m.return_area = std::max(m.return_area, return_area(text.data(), text.data() + text.size()));
+    max_return_area = std::max(max_return_area, m.return_area);
+    m.memo_ids += updated.memo_ids;
+
+    // a function that kept its body may call one that did not, none of the module's results can be trusted
+    memo.clear(static_cast<std::uint16_t>(mod_idx));
+
+    return true;
+}
+
+bool state::link_imports(module& m, std::vector<compile_message>& messages) const {
+    auto success = true;
+    for (const auto& r : m.relocations) {
+        const auto& imp = m.imports[r.import];
+        const auto& name = imp.symbols[r.symbol].name;
+        auto mod_idx = find_module(imp.modname);
+        if (!mod_idx) {
+            messages.emplace_back("Module not loaded: " + imp.modname, location{});
+            success = false;
+            continue;
+        }
+        auto e = find_export(*mod_idx, name);
+        if (!e) {
+            messages.emplace_back("Module " + imp.modname + " does not export " + name, location{});
+            success = false;
+            continue;
+        }
+        auto adr = program_addr{e->addr, static_cast<std::uint16_t>(*mod_idx)};
+        std::memcpy(m.data.data() + r.offset, &adr, sizeof(adr));
+    }
+    return success;
+}
+
+bool state::link_natives(module& m, std::vector<compile_message>& messages) const {
+    auto success = true;
+    m.native_ids.clear();
+    for (const auto& n : m.natives) {
+        auto id = natives.find(n.name, n.signature);
+        if (!id) {
+            messages.emplace_back("Host function not registered: " + n.name + " " + n.signature, location{});
+            success = false;
+            continue;
+        }
+        m.native_ids.push_back(*id);
+    }
+    return success;
+}
+
+bool state::verify(const module& m, std::vector<compile_message>& messages) const {
+    auto problems = verify_module(*this, m);
+    for (auto& problem : problems) {
+        messages.emplace_back("Module " + m.name + " failed verification " + problem, location{});
+    }
+    return problems.empty();
+}
+
+translation state::compile_module(const std::string& name, std::string_view source_code, unsigned threads) {
+    if (!cache) {
+        return compile(*this, name, source_code, threads);
+    }
+
+    auto key = cache.key(*this, source_code);
+
+    // entries are only as trustworthy as the cache directory, a bad one is compiled again
+    if (auto m = cache.find(key); m && verify_module(*this, *m).empty()) {
+        m->name = name;
+        return {result::SUCCESS, std::move(*m), {}, {}};
+    }
+
+    auto tu = compile(*this, name, source_code, threads);
+    if (tu.r == result::SUCCESS && !tu.m.pending) {
+        cache.store(key, tu.m);
+    }
+    return tu;
+}
+
+bool state::resolve(std::int16_t mod_idx, std::int32_t func_idx) {
+    auto& m = modules[mod_idx];
+    if (!m.pending || func_idx < 0 || std::size_t(func_idx) >= m.pending->stubs.size()) {
+        return false;
+    }
+    return compile_pending(m, func_idx);
+}
+
+interp_result state::execute(std::int16_t mod_idx, std::uint32_t func_addr, int ret_size) {
     return interp(*this, mod_idx, func_addr, ret_size);
 }
 
-std::int16_t state::get_entry_point(std::int16_t mod_idx) const {
+std::uint32_t state::get_entry_point(std::int16_t mod_idx) const {
     return modules[mod_idx].entry_point;
 }
 
+std::optional<std::int16_t> state::find_module(std::string_view name) const {
+    auto iter = module_index.find(std::string(name));
+    if (iter != module_index.end()) {
+        return iter->second;
+    } else {
+        return std::nullopt;
+    }
+}
+
+const symbol* state::find_export(std::int16_t mod_idx, std::string_view name) const {
+    const auto& exports = export_index[mod_idx];
+    auto iter = exports.find(std::string(name));
+    if (iter != exports.end()) {
+        return &modules[mod_idx].exports[iter->second];
+    } else {
+        return nullptr;
+    }
+}
+
 }
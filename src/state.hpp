@@ -1,21 +1,29 @@
 #pragma once
 
 #include "types.hpp"
+#include "bytecode_cache.hpp"
 #include "compile_message.hpp"
+#include "loader.hpp"
 #include "script_context.hpp"
 #include "interp_result.hpp"
+#include "translation.hpp"
+#include "memo_cache.hpp"
+#include "native_registry.hpp"
+#include "type_interner.hpp"
 
 #include <iostream>
 #include <optional>
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 
 namespace moonflower {
 
 struct load_result {
     std::optional<std::int16_t> mod_idx;
     std::vector<compile_message> messages;
+    monotonic_arena::stats arena_stats;
 };
 
 class state {
@@ -23,14 +31,78 @@ public:
     std::unique_ptr<std::byte[]> stack;
     std::size_t stacksize;
     std::vector<module> modules;
+    memo_cache memo;
+    native_registry natives; // host functions modules call, added before loading the modules that call them
+    type_interner types;
+    unsigned compile_threads = 0; // threads for optimizing function bodies, 0 means one per core
+    bytecode_cache cache;
+    std::int16_t max_return_area = 0; // largest return_area of the loaded modules, the least retc interp accepts
+    bool lazy = false; // compile function bodies on their first call rather than at load, see pending_functions
+    bool compact = false; // run modules from their 32-bit encoding, see compact_text.hpp
+    int running = 0; // interp calls in progress, modules are not reloaded under them
 
+    // Indexes every module by name and its exports by name, so imports are resolved without scanning.
+    // Calls to imported functions are linked into immediate cross-module calls, and calls to host functions into
+    // calls by id. Returns -1 if the module calls a host function that is not in natives.
     std::int16_t load(module m);
 
     load_result load(const std::string& name, std::istream& source_code);
 
-    interp_result execute(std::int16_t mod_idx, std::int16_t func_addr, int ret_size);
+    load_result load(const std::string& name, std::string_view source_code);
 
-    std::int16_t get_entry_point(std::int16_t mod_idx) const;
+    // Loads a module file written by write_module, linking its imports to the modules already loaded.
+    // The module is verified first, so untrusted files run as fast as compiled scripts.
+    load_result load_compiled(const std::string& path);
+
+    // Compiles a new version of a loaded module and swaps it in, see below.
+    load_result reload(std::int16_t mod_idx, std::string_view source_code);
+
+    // Swaps a new version of a loaded module in place of the old one. Functions are matched by name; only those whose
+    // body hash differs, and new ones, are appended to the module's text, and the entry of each changed function
+    // becomes a jump to its new body. Unchanged functions, addresses held by other modules and frames returning into
+    // the module all stay valid, so the pause grows with the size of the change. Refused while a script is running,
+    // or when the module was not compiled from source.
+    bool reload(std::int16_t mod_idx, module updated, std::vector<compile_message>& messages);
+
+    // Compiles without loading, taking the module from the bytecode cache when it has it. Function bodies are optimized
+    // on `threads` threads, see compile_threads.
+    translation compile_module(const std::string& name, std::string_view source_code, unsigned threads);
+
+    // Writes every loaded module to a state image, see write_image. Lazy functions that never ran are compiled first.
+    bool save_image(std::ostream& out, std::string& error);
+
+    // Replaces the loaded modules with those of an image written by save_image, ready to execute without compiling or
+    // linking anything but the host functions they call, which must be in natives. Images are not verified, so only
+    // restore images the host wrote itself.
+    bool restore_image(const std::string& path, std::string& error);
+
+    // Compiles a function of a lazily compiled module, called by interp when it reaches the function's LAZY stub.
+    bool resolve(std::int16_t mod_idx, std::int32_t func_idx);
+
+    interp_result execute(std::int16_t mod_idx, std::uint32_t func_addr, int ret_size);
+
+    std::uint32_t get_entry_point(std::int16_t mod_idx) const;
+
+    // The first loaded module with the given name.
+    std::optional<std::int16_t> find_module(std::string_view name) const;
+
+    const symbol* find_export(std::int16_t mod_idx, std::string_view name) const;
+
+private:
+    // Indexes a linked module and appends it to modules.
+    std::int16_t add_module(module m);
+
+    // Writes the program_addr of every imported function into the module's data segment.
+    bool link_imports(module& m, std::vector<compile_message>& messages) const;
+
+    // Finds the id of every host function the module calls.
+    bool link_natives(module& m, std::vector<compile_message>& messages) const;
+
+    bool verify(const module& m, std::vector<compile_message>& messages) const;
+
+    std::unordered_map<std::string, std::int16_t> module_index;
+    std::vector<std::unordered_map<std::string, std::uint32_t>> export_index; // per module, name to position in exports
+    std::vector<std::unordered_map<std::string, std::uint32_t>> function_index; // per module, name to position in functions
 };
 
 }
@@ -0,0 +1,24 @@
+#include "symbol_table.hpp"
+
+namespace moonflower {
+
+symbol_table::symbol_table(monotonic_arena& arena) : arena(&arena), ids(&arena), names(&arena) {}
+
+auto symbol_table::intern(std::string_view name) -> symbol_id {
+    auto iter = ids.find(name);
+    if (iter != end(ids)) {
+        return iter->second;
+    }
+
+    auto s = symbol_id(names.size());
+    auto stored = arena->copy(name);
+    names.push_back(stored);
+    ids.emplace(stored, s);
+    return s;
+}
+
+auto symbol_table::name(symbol_id s) const -> std::string_view {
+    return names[static_cast<std::uint32_t>(s)];
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "arena.hpp"
+
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace moonflower {
+
+// An interned identifier. Two symbols from the same table are equal exactly when their names are.
+enum class symbol_id : std::uint32_t {};
+
+// Interns the identifiers of one translation unit; the names live in the arena.
+class symbol_table {
+public:
+    explicit symbol_table(monotonic_arena& arena);
+
+    auto intern(std::string_view name) -> symbol_id;
+
+    auto name(symbol_id s) const -> std::string_view;
+
+private:
+    monotonic_arena* arena;
+    std::pmr::unordered_map<std::string_view, symbol_id> ids;
+    std::pmr::vector<std::string_view> names;
+};
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "arena.hpp"
 #include "types.hpp"
 #include "compile_message.hpp"
 
@@ -14,6 +15,7 @@ struct translation {
     result r;
     module m;
     std::vector<compile_message> messages;
+    monotonic_arena::stats arena_stats;
 };
 
 }
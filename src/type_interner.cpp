@@ -0,0 +1,76 @@
+#include "type_interner.hpp"
+
+#include <functional>
+
+namespace moonflower {
+
+type_interner::type_interner() {
+    nothing_type = make(type::nothing{});
+}
+
+auto type_interner::nothing() const -> type_ptr {
+    return nothing_type;
+}
+
+auto type_interner::function(const type::function& f) -> type_ptr {
+    auto lock = std::lock_guard(mutex);
+    return function_unlocked(f);
+}
+
+auto type_interner::function_unlocked(const type::function& f) -> type_ptr {
+    auto sig = std::vector<type_ptr>{};
+    sig.reserve(f.params.size() + 1);
+    sig.push_back(f.ret_type);
+    sig.insert(sig.end(), f.params.begin(), f.params.end());
+
+    auto iter = functions.find(sig);
+    if (iter != end(functions)) {
+        return iter->second;
+    }
+
+    auto t = make(f);
+    functions.emplace(std::move(sig), t);
+    return t;
+}
+
+auto type_interner::function_ptr(const type::function& base) -> type_ptr {
+    auto lock = std::lock_guard(mutex);
+    auto f = function_unlocked(base);
+
+    auto& t = function_ptrs[f];
+    if (!t) {
+        t = make(type::function_ptr{base});
+    }
+    return t;
+}
+
+auto type_interner::new_usertype(const std::string& name) -> type::usertype& {
+    auto lock = std::lock_guard(mutex);
+    auto& t = nodes.emplace_back(type::usertype{});
+    globals[name] = &t;
+    return std::get<type::usertype>(t.t);
+}
+
+auto type_interner::global(const std::string& name) const -> type_ptr {
+    auto lock = std::lock_guard(mutex);
+    auto iter = globals.find(name);
+    if (iter != end(globals)) {
+        return iter->second;
+    } else {
+        return nullptr;
+    }
+}
+
+auto type_interner::make(type::variant v) -> type_ptr {
+    return &nodes.emplace_back(std::move(v));
+}
+
+std::size_t type_interner::signature_hash::operator()(const std::vector<type_ptr>& sig) const {
+    auto h = sig.size();
+    for (auto t : sig) {
+        h ^= std::hash<type_ptr>{}(t) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    }
+    return h;
+}
+
+}
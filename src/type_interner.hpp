@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace moonflower {
+
+// Owns the types of every module compiled into a state.
+// Function and function pointer types are hash-consed on their (already interned) components, so structurally equal
+// types share one node and comparing types is a pointer compare. Usertypes are nominal and each gets its own node.
+// Safe to use from several compiles at once; nodes never move while the interner lives.
+class type_interner {
+public:
+    type_interner();
+
+    type_interner(const type_interner&) = delete;
+    type_interner& operator=(const type_interner&) = delete;
+
+    auto nothing() const -> type_ptr;
+
+    auto function(const type::function& f) -> type_ptr;
+
+    auto function_ptr(const type::function& base) -> type_ptr;
+
+    // Adds a named usertype for the caller to fill in.
+    auto new_usertype(const std::string& name) -> type::usertype&;
+
+    // Returns nullptr if there is no global type with that name.
+    auto global(const std::string& name) const -> type_ptr;
+
+    // Calls define(*this) the first time it is called, so concurrent compiles share one set of builtin types.
+    template <typename F>
+    void define_builtins(F&& define) {
+        std::call_once(builtins_defined, std::forward<F>(define), *this);
+    }
+
+private:
+    struct signature_hash {
+        std::size_t operator()(const std::vector<type_ptr>& sig) const;
+    };
+
+    auto make(type::variant v) -> type_ptr;
+
+    auto function_unlocked(const type::function& f) -> type_ptr;
+
+    mutable std::mutex mutex;
+    std::once_flag builtins_defined;
+    std::deque<type> nodes;
+    type_ptr nothing_type;
+    std::unordered_map<std::vector<type_ptr>, type_ptr, signature_hash> functions; // return type then params
+    std::unordered_map<type_ptr, type_ptr> function_ptrs; // function type to its pointer type
+    std::unordered_map<std::string, type_ptr> globals;
+};
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "segment.hpp"
 #include "utility.hpp"
 
 #include <cstdint>
@@ -14,6 +15,7 @@
 namespace moonflower {
 
 class state;
+struct pending_functions;
 
 enum opcode : std::uint8_t {
     TERMINATE, // A: return code)
@@ -23,6 +25,10 @@ enum opcode : std::uint8_t {
     BSETC, // A: dest, DI: boolean value
     SETADR, // A: dest, DI: text address value
     SETDAT, // A: dest, B: data address, C: size
+    SETXADR, // A: dest, B: module index, C: text address
+             // written by the linker in place of the SETDAT that loads an imported function's program_addr
+    SETDATW, // A: dest, DI: data address, R: size
+             // SETDAT for data addresses past the reach of B
 
     CPY, // A: dest, B: source, C: count
 
@@ -31,9 +37,24 @@ enum opcode : std::uint8_t {
     IMUL, // A: dest, B: x, C: y
     IDIV, // A: dest, B: x, C: y
     ICLT, // A: dest, B: x, C: y
+    IMOD, // A: dest, B: x, C: y
+    ISHL, // A: dest, B: x, C: y
+    ISHR, // A: dest, B: x, C: y
+    IAND, // A: dest, B: x, C: y
+    IOR, // A: dest, B: x, C: y
+    IXOR, // A: dest, B: x, C: y
 
     IADDC, // A: dest, B: x, C: constant
     ICLTC, // A: dest, B: x, C: constant
+    IMULC, // A: dest, B: x, C: constant
+    IDIVC, // A: dest, B: x, C: constant
+    IMODC, // A: dest, B: x, C: constant
+    ISHLC, // A: dest, B: x, C: constant
+    ISHRC, // A: dest, B: x, C: constant
+    IANDC, // A: dest, B: x, C: constant
+    IORC, // A: dest, B: x, C: constant
+    IXORC, // A: dest, B: x, C: constant
+    ICNEC, // A: dest, B: x, C: constant
 
     FADD, // A: dest, B: x, C: y
     FSUB, // A: dest, B: x, C: y
@@ -42,11 +63,27 @@ enum opcode : std::uint8_t {
 
     JMP, // DI: text address to jump to, relative to PC
     JMPIFN, // A: stack addr of boolean value, DI: text address to jump to if false, relative to PC
+    JMPTAB, // A: stack addr of int index, B: data addr of table, C: table size
+            // table: lowest index, then C jump offsets relative to PC, falls through if out of range
+            // the table size is also stored in the int before the table
+    JMPTABW, // A: stack addr of int index, DI: data addr of table
+             // JMPTAB for data addresses past the reach of B, reads the table size from before the table
+    FORPREP, // A: stack addr of int counter, limit and step, DI: text address to jump to if the loop runs zero times (always with a step of 0), relative to PC
+    FORLOOP, // A: stack addr of int counter, limit and step, DI: text address of the loop body, relative to PC
+             // adds step to counter, jumps while counter is below limit (above it for a negative step)
     CALL, // A: stack top, B: stack addr of program_addr to call
     RET, // no args
-
-    CFLOAD, // A: dest, B: cfunc id
-    CFCALL, // A: data addr of cfunc
+    MEMOGET, // A: stack addr of the arguments, B: argument size, C: cache id, R: return value size
+             // returns with the cached return value if the function has seen these arguments before
+    MEMOSET, // A: stack addr of the arguments, B: argument size, C: cache id, R: return value size
+    LAZY, // DI: function index in module::pending
+          // entry stub of a function that is not compiled yet, becomes a JMP to its body on the first call
+
+    CFLOAD, // A: dest, DI: native id
+            // loads the host function pointer, as for a polyfunc_rep
+    CFCALL, // DI: native id
+            // calls the host function with the stack at the frame base
+            // a native id indexes module::natives until state::load links it to an id of state::natives
 
     PFCALL, // A: stack top, B: stack addr of polyfunc_rep
 };
@@ -92,12 +129,19 @@ enum class binop : std::uint8_t {
     SUB,
     MUL,
     DIV,
+    MOD,
+    SHL,
+    SHR,
+    AND,
+    OR,
+    XOR,
     CLT,
 };
 
 struct type;
 
-using type_ptr = std::shared_ptr<type>;
+// Types are owned and interned by the state's type_interner, so two types are the same exactly when their pointers are.
+using type_ptr = const type*;
 
 struct field_def {
     int offset;
@@ -116,7 +160,7 @@ namespace addresses {
     };
 
     struct data {
-        std::int16_t value;
+        std::int32_t value;
     };
 
     using address = std::variant<local, global, data>;
@@ -129,6 +173,7 @@ struct binop_def {
     type_ptr return_type;
     std::function<void(script_context& context, const address& dest, const address& lhs, const address& rhs)> emit;
     std::function<void(script_context& context, const address& dest, const address& lhs, std::int16_t rhs)> emit_c_int;
+    bool nonzero_rhs = false; // a constant rhs of 0 is a compile error, as for division
 };
 
 struct type {
@@ -166,12 +211,9 @@ struct type {
 };
 
 struct program_addr {
+    std::uint32_t off;
     std::uint16_t mod;
-    std::uint16_t off;
-};
-
-struct stack_rep {
-    std::uint16_t soff;
+    std::uint16_t reserved = 0; // holds the caller's stack offset in a frame's return linkage, see interp
 };
 
 using cfunc = void(state* s, std::byte* stk);
@@ -191,7 +233,7 @@ struct polyfunc_rep {
 
 struct symbol {
     std::string name;
-    std::uint16_t addr;
+    std::uint32_t addr;
 };
 
 struct import {
@@ -199,13 +241,52 @@ struct import {
     std::vector<symbol> symbols;
 };
 
+// A program_addr in the data segment that refers to a function of another module, filled in when the module is loaded.
+struct relocation {
+    std::uint32_t offset; // data segment offset of the program_addr
+    std::uint16_t import; // index into module::imports
+    std::uint16_t symbol; // index into that import's symbols
+};
+
+// A function of a module compiled from source, found again by name when the module is reloaded.
+struct function_info {
+    std::string name;
+    std::uint32_t entry; // text address callers were given, which stays valid across reloads
+    std::uint32_t begin; // extent of the current body
+    std::uint32_t end;
+    std::uint64_t hash = 0; // of the body wherever it is placed, set by state::load, 0 if unknown
+};
+
+// The text of a module in the 32-bit encoding, see compact_text.hpp.
+struct compact_text {
+    std::vector<std::uint32_t> words; // one per instruction of the text, empty until encoded
+    std::vector<instruction> wide; // instructions too large for a word
+};
+
+// A host function a module calls, bound to a function of the state's native_registry when the module is loaded.
+// The signature is whatever the host registered the function with, it only has to match.
+struct native_import {
+    std::string name;
+    std::string signature;
+};
+
+constexpr std::uint32_t no_entry_point = 0xffffffff;
+
 struct module {
     std::string name;
-    std::vector<instruction> text;
-    std::vector<std::byte> data;
+    segment<instruction> text;
+    segment<std::byte> data;
     std::vector<symbol> exports;
     std::vector<import> imports;
-    std::uint16_t entry_point;
+    std::vector<relocation> relocations;
+    std::vector<native_import> natives;
+    std::vector<std::uint32_t> native_ids; // id of each native in state::natives, set by state::load
+    std::uint32_t entry_point; // no_entry_point if the module has no main
+    std::int16_t return_area = 0; // bytes below their frame its functions touch, set by state::load
+    std::shared_ptr<pending_functions> pending; // bodies behind LAZY stubs, shared by copies of the module
+    std::vector<function_info> functions; // empty unless compiled from source
+    std::int16_t memo_ids = 0; // memo cache ids its functions use, set by the compiler
+    compact_text compact; // set when the module first runs with state::compact
 };
 
 inline std::string to_string(const type& t) {
@@ -221,45 +302,6 @@ inline std::string to_string(const type_ptr& t) {
     return to_string(*t);
 }
 
-inline bool operator==(const type& a, const type& b);
-inline bool operator!=(const type& a, const type& b);
-
-inline bool operator==(const type::function& a_f, const type::function& b_f) {
-    if (*a_f.ret_type != *b_f.ret_type) {
-        return false;
-    }
-
-    if (a_f.params.size() != b_f.params.size()) {
-        return false;
-    }
-
-    for (auto i = 0; i < a_f.params.size(); ++i) {
-        if (*a_f.params[i] != *b_f.params[i]) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-inline bool operator==(const type& a, const type& b) {
-    return std::visit(overload {
-        [](const type::nothing&, const type::nothing&) { return true; },
-        [](const type::function& a_f, const type::function& b_f) {return a_f == b_f; },
-        [](const type::function_ptr& a_c, const type::function_ptr& b_c) { return a_c.base == b_c.base; },
-        [](const type::usertype& a_ut, const type::usertype& b_ut) { return &a_ut == &b_ut; },
-        [](const auto&, const auto&) { return false; }
-    }, a.t, b.t);
-}
-
-inline bool operator!=(const type& a, const type& b) {
-    return !(a == b);
-}
-
-inline type_ptr make_type_ptr(type::variant v) {
-    return std::make_shared<type>(std::move(v));
-}
-
 inline std::int16_t value_size(const type& t) {
     return std::visit(overload {
         [](const type::nothing&) { return 0ull; },
@@ -290,7 +332,7 @@ inline auto get_binop(binop op, const type::usertype& ut, const type_ptr& rhs) -
     auto iter = ut.binops.find(op);
     if (iter != end(ut.binops)) {
         for (const auto& def : iter->second) {
-            if (*def.rhs_type == *rhs) {
+            if (def.rhs_type == rhs) {
                 return &def;
             }
         }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 namespace moonflower {
 
@@ -26,4 +29,70 @@ private:
     std::unique_ptr<T> data;
 };
 
+class dynamic_bitset {
+public:
+    dynamic_bitset() = default;
+    explicit dynamic_bitset(std::size_t n) : words((n + 63) / 64, 0) {}
+
+    bool test(std::size_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+    void set(std::size_t i) { words[i / 64] |= std::uint64_t{1} << (i % 64); }
+    void reset(std::size_t i) { words[i / 64] &= ~(std::uint64_t{1} << (i % 64)); }
+
+    // returns true if any bits were added
+    bool merge(const dynamic_bitset& o) {
+        bool changed = false;
+        for (std::size_t w = 0; w < words.size(); ++w) {
+            auto n = words[w] | o.words[w];
+            changed |= n != words[w];
+            words[w] = n;
+        }
+        return changed;
+    }
+
+    template <typename F>
+    void for_each(F&& f) const {
+        for (std::size_t w = 0; w < words.size(); ++w) {
+            for (std::size_t b = 0; b < 64 && words[w] >> b != 0; ++b) {
+                if ((words[w] >> b) & 1) {
+                    f(w * 64 + b);
+                }
+            }
+        }
+    }
+
+    friend bool operator==(const dynamic_bitset& a, const dynamic_bitset& b) { return a.words == b.words; }
+    friend bool operator!=(const dynamic_bitset& a, const dynamic_bitset& b) { return a.words != b.words; }
+
+private:
+    std::vector<std::uint64_t> words;
+};
+
+class hasher {
+public:
+    void add(const void* p, std::size_t size) {
+        // FNV-1a
+        auto bytes = static_cast<const unsigned char*>(p);
+        for (std::size_t i = 0; i < size; ++i) {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+    }
+
+    void add(std::string_view s) {
+        auto size = static_cast<std::uint64_t>(s.size());
+        add(&size, sizeof(size));
+        add(s.data(), s.size());
+    }
+
+    template <typename T>
+    void add_value(const T& v) {
+        add(&v, sizeof(v));
+    }
+
+    auto get() const -> std::uint64_t { return h; }
+
+private:
+    std::uint64_t h = 14695981039346656037ull;
+};
+
 }
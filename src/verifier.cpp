@@ -0,0 +1,348 @@
+#include "verifier.hpp"
+
+#include "instruction_info.hpp"
+#include "script_context.hpp"
+#include "state.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace moonflower {
+
+namespace {
+
+constexpr int linkage_size = 8; // return address and caller stack, written by CALL
+
+// Stack slots known to hold a valid program_addr, with the module it points into, sorted by slot.
+using addr_slots = std::vector<std::pair<int, int>>;
+
+void kill(addr_slots& slots, int addr, int size) {
+    slots.erase(std::remove_if(slots.begin(), slots.end(), [&](const auto& s) {
+        return s.first < addr + size && addr < s.first + int(sizeof(program_addr));
+    }), slots.end());
+}
+
+void gen(addr_slots& slots, int addr, int mod) {
+    kill(slots, addr, sizeof(program_addr));
+    auto pos = std::lower_bound(slots.begin(), slots.end(), std::make_pair(addr, mod));
+    slots.insert(pos, {addr, mod});
+}
+
+auto target_of(const addr_slots& slots, int addr) -> std::optional<int> {
+    auto iter = std::lower_bound(slots.begin(), slots.end(), std::make_pair(addr, -1));
+    if (iter != slots.end() && iter->first == addr) {
+        return iter->second;
+    }
+    return std::nullopt;
+}
+
+// Keeps only the slots both sides agree on, returns whether `into` changed.
+bool meet(addr_slots& into, const addr_slots& other) {
+    auto size = into.size();
+    into.erase(std::remove_if(into.begin(), into.end(), [&](const auto& s) {
+        return !std::binary_search(other.begin(), other.end(), s);
+    }), into.end());
+    return into.size() != size;
+}
+
+bool is_export(const module& m, std::uint32_t addr) {
+    return std::any_of(m.exports.begin(), m.exports.end(), [&](const symbol& e) { return e.addr == addr; });
+}
+
+class verifier {
+public:
+    verifier(const state& S, const module& m) :
+        S(S), m(m), self(static_cast<int>(S.modules.size())), size(static_cast<int>(m.text.size())), area(return_area(m)) {}
+
+    auto run() -> std::vector<std::string> {
+        if (area > script_context::stack_max) {
+            errors.push_back("return area is larger than a frame");
+        }
+
+        for (const auto& r : m.relocations) {
+            auto adr = program_addr{};
+            if (r.offset > m.data.size() || m.data.size() - r.offset < sizeof(adr)) {
+                errors.push_back("relocation outside the data segment");
+                continue;
+            }
+            std::memcpy(&adr, m.data.data() + r.offset, sizeof(adr));
+            if (adr.mod >= S.modules.size() || !is_export(S.modules[adr.mod], adr.off)) {
+                errors.push_back("import does not refer to an exported function");
+                continue;
+            }
+            relocated.emplace(r.offset, adr.mod);
+        }
+
+        if (m.entry_point != no_entry_point) {
+            add_entry(-1, m.entry_point);
+        }
+        for (const auto& e : m.exports) {
+            add_entry(-1, e.addr);
+        }
+
+        // SETADR targets found while walking are appended
+        for (std::size_t i = 0; i < entries.size() && errors.empty(); ++i) {
+            walk(entries[i]);
+        }
+
+        return std::move(errors);
+    }
+
+private:
+    void error(int pc, const std::string& what) {
+        errors.push_back("at " + std::to_string(pc) + ": " + what);
+    }
+
+    bool add_entry(int pc, int addr) {
+        if (addr < 0 || addr >= size) {
+            error(pc, "function address outside the text");
+            return false;
+        }
+        if (walked.insert(addr).second) {
+            entries.push_back(addr);
+        }
+        return true;
+    }
+
+    bool check_data(int pc, std::int64_t addr, std::int64_t bytes) {
+        if (addr < 0 || bytes < 0 || addr + bytes > static_cast<std::int64_t>(m.data.size())) {
+            error(pc, "data access outside the data segment");
+            return false;
+        }
+        return true;
+    }
+
+    int area_of(int mod) const {
+        return mod == self ? area : S.modules[mod].return_area;
+    }
+
+    void walk(int entry) {
+        auto states = std::unordered_map<int, addr_slots>{};
+        auto work = std::vector<int>{entry};
+        auto succs = std::vector<int>{};
+        states[entry] = {};
+
+        while (!work.empty()) {
+            auto pc = work.back();
+            work.pop_back();
+
+            auto slots = states[pc];
+            succs.clear();
+            if (!step(pc, slots, succs)) {
+                return;
+            }
+
+            for (auto succ : succs) {
+                if (succ < 0 || succ >= size) {
+                    error(pc, "control leaves the text");
+                    return;
+                }
+                auto [iter, inserted] = states.try_emplace(succ, slots);
+                if (inserted || meet(iter->second, slots)) {
+                    work.push_back(succ);
+                }
+            }
+        }
+    }
+
+    bool step(int pc, addr_slots& slots, std::vector<int>& succs) {
+        const auto& instr = m.text[pc];
+
+        if (instr.OP > PFCALL) {
+            error(pc, "invalid opcode");
+            return false;
+        }
+        if (instr.OP == PFCALL) {
+            error(pc, "polymorphic calls through a stack pointer cannot be verified");
+            return false;
+        }
+        if (instr.OP == LAZY) {
+            error(pc, "function was never compiled");
+            return false;
+        }
+
+        // a copy reads its source before the writes below clear it
+        auto copied = addr_slots{};
+        if (instr.OP == CPY) {
+            for (const auto& s : slots) {
+                if (s.first >= instr.BC.B && s.first + int(sizeof(program_addr)) <= instr.BC.B + instr.BC.C) {
+                    copied.emplace_back(s.first - instr.BC.B + instr.A, s.second);
+                }
+            }
+        }
+
+        for (const auto& op : stack_operands(instr)) {
+            if (op.mode == access::FRAME) {
+                continue;
+            }
+            int addr = get_field(instr, op.field);
+            if (op.size < 0 || addr + op.size > script_context::stack_max) {
+                error(pc, "stack operand outside the frame");
+                return false;
+            }
+            if (op.mode == access::WRITE) {
+                if (addr < linkage_size && addr + op.size > 0) {
+                    error(pc, "overwrites the return linkage");
+                    return false;
+                }
+                kill(slots, addr, op.size);
+            }
+        }
+
+        switch (instr.OP) {
+            case SETADR:
+                if (!add_entry(pc, instr.DI)) {
+                    return false;
+                }
+                gen(slots, instr.A, self);
+                break;
+            case SETXADR: {
+                auto mod = int(instr.BC.B);
+                if (mod < 0 || mod >= int(S.modules.size()) || !is_export(S.modules[mod], std::uint16_t(instr.BC.C))) {
+                    error(pc, "cross-module address is not an exported function");
+                    return false;
+                }
+                gen(slots, instr.A, mod);
+                break;
+            }
+            case SETDAT:
+            case SETDATW: {
+                auto addr = instr.OP == SETDAT ? instr.BC.B : instr.DI;
+                auto bytes = instr.OP == SETDAT ? instr.BC.C : instr.R;
+                if (!check_data(pc, addr, bytes)) {
+                    return false;
+                }
+                auto iter = relocated.find(addr);
+                if (bytes == sizeof(program_addr) && iter != relocated.end()) {
+                    gen(slots, instr.A, iter->second);
+                }
+                break;
+            }
+            case CPY:
+                if (instr.BC.C < 0) {
+                    error(pc, "negative copy size");
+                    return false;
+                }
+                for (const auto& s : copied) {
+                    gen(slots, s.first, s.second);
+                }
+                break;
+            case JMPTAB:
+            case JMPTABW: {
+                // the table size is stored before the table, and must be the one JMPTAB was given
+                auto table = instr.OP == JMPTAB ? int(instr.BC.B) : instr.DI;
+                auto count = std::int32_t{-1};
+                if (table >= int(sizeof(count)) && table <= int(m.data.size())) {
+                    std::memcpy(&count, m.data.data() + table - sizeof(count), sizeof(count));
+                }
+                if (count < 0 || (instr.OP == JMPTAB && count != instr.BC.C) || count > int(m.data.size()) ||
+                    table % sizeof(std::int32_t) != 0 || !check_data(pc, table, (1 + count) * sizeof(std::int32_t))) {
+                    error(pc, "bad jump table");
+                    return false;
+                }
+                for (int i = 0; i < count; ++i) {
+                    auto offset = std::int32_t{};
+                    std::memcpy(&offset, m.data.data() + table + (1 + i) * sizeof(offset), sizeof(offset));
+                    succs.push_back(pc + 1 + offset);
+                }
+                break;
+            }
+            case CALL: {
+                auto target = target_of(slots, instr.BC.B);
+                if (!target) {
+                    error(pc, "call through an address that is not a function");
+                    return false;
+                }
+                auto callee_area = area_of(*target);
+                if (instr.A - callee_area < linkage_size || instr.A + linkage_size > script_context::stack_max) {
+                    error(pc, "callee frame overlaps the caller's linkage or leaves the frame");
+                    return false;
+                }
+                // the callee owns everything from its return value up
+                kill(slots, instr.A - callee_area, script_context::stack_max);
+                break;
+            }
+            case CFLOAD:
+            case CFCALL:
+                if (instr.DI < 0 || instr.DI >= int(m.natives.size())) {
+                    error(pc, "host function is not one of the module's natives");
+                    return false;
+                }
+                if (instr.OP == CFCALL) {
+                    slots.clear(); // the host function may write anywhere in the frame
+                }
+                break;
+            case IDIVC:
+            case IMODC:
+                // the compiler folds these away, INT_MIN / -1 would trap like a division by zero
+                if (instr.BC.C == 0 || instr.BC.C == -1) {
+                    error(pc, "division by a constant 0 or -1");
+                    return false;
+                }
+                break;
+            case MEMOGET:
+            case MEMOSET:
+                if (instr.BC.B < 0) {
+                    error(pc, "negative memo key size");
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+
+        if (auto target = jump_target(instr, pc)) {
+            succs.push_back(*target);
+        }
+        if (falls_through(instr.OP)) {
+            succs.push_back(pc + 1);
+        }
+        return true;
+    }
+
+    const state& S;
+    const module& m;
+    int self; // index the module gets when it is loaded
+    int size;
+    int area;
+    std::vector<std::string> errors;
+    std::unordered_map<int, int> relocated; // data offset of each import, to the module it points into
+    std::unordered_set<int> walked;
+    std::vector<int> entries;
+};
+
+}
+
+std::int16_t return_area(const module& m) {
+    return return_area(m.text.begin(), m.text.end());
+}
+
+std::int16_t return_area(const instruction* first, const instruction* last) {
+    auto area = 0;
+    for (auto iter = first; iter < last; ++iter) {
+        const auto& instr = *iter;
+        if (instr.OP > PFCALL) {
+            continue;
+        }
+        for (const auto& op : stack_operands(instr)) {
+            int addr = get_field(instr, op.field);
+            if (op.mode != access::FRAME && addr < 0) {
+                area = std::max(area, -addr);
+            }
+        }
+        if (instr.OP == MEMOGET || instr.OP == MEMOSET) {
+            area = std::max(area, int(instr.R));
+        }
+    }
+    return static_cast<std::int16_t>(std::min(area, 0x7fff));
+}
+
+std::vector<std::string> verify_module(const state& S, const module& m) {
+    return verifier{S, m}.run();
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace moonflower {
+
+// Bytes the module's functions read or write below their frame base, where the caller keeps the return value.
+std::int16_t return_area(const module& m);
+
+std::int16_t return_area(const instruction* first, const instruction* last);
+
+// Checks that a module which is about to be loaded into `S` runs safely without runtime checks:
+//  - every opcode is known, host functions are called by native id rather than through a pointer (PFCALL), and
+//    every native id is one of the module's natives
+//  - jump targets and jump tables land on instructions of the text, and no function runs off its end
+//  - data addresses, jump tables and imported program_addrs lie inside the data segment and point where they should
+//  - stack operands fit in a frame of script_context::stack_max bytes, only dip below the frame base by return_area(m),
+//    and never overwrite the return linkage
+//  - every CALL goes through a program_addr made by SETADR, SETXADR or an import, and leaves room below the callee
+//    frame for the callee's return value
+//  - IDIVC and IMODC never divide by 0 or -1
+// What is left to the interpreter is the call depth, checked by CALL against the stack size, and IDIV and IMOD with a
+// divisor of 0, or INT_MIN divided by -1, which end the run with an error.
+// Functions are found from the entry point, the exports and SETADR targets. Returns the problems found.
+std::vector<std::string> verify_module(const state& S, const module& m);
+
+}